@@ -0,0 +1,351 @@
+#include "block_device.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "config.h"
+#include "util.h"
+
+namespace {
+BlockDevice& from_config(const struct lfs_config* c) {
+  return *static_cast<BlockDevice*>(c->context);
+}
+}  // namespace
+
+BlockDevice::Page::~Page() {
+  for (lfs_size_t i = 0; i < kPageBlocks; ++i) {
+    if (!borrowed[i]) {
+      delete[] blocks[i];
+    }
+  }
+}
+
+BlockDevice::BlockDevice(const lfs_size_t block_count)
+    : block_count(block_count),
+      pages((block_count + kPageBlocks - 1) / kPageBlocks) {}
+
+BlockDevice::~BlockDevice() {
+  pages.clear();
+  free(image);
+}
+
+uint8_t* BlockDevice::lookup(const lfs_block_t block) const {
+  const auto& page = pages[block / kPageBlocks];
+  if (!page) {
+    return nullptr;
+  }
+  return page->blocks[block % kPageBlocks];
+}
+
+uint8_t* BlockDevice::materialize(const lfs_block_t block) {
+  auto& page = pages[block / kPageBlocks];
+  if (!page) {
+    page = std::make_unique<Page>();
+  }
+
+  auto& data = page->blocks[block % kPageBlocks];
+  if (!data) {
+    if (spare.empty()) {
+      data = new uint8_t[kBlockSize]();
+    } else {
+      data = spare.back().release();
+      spare.pop_back();
+      memset(data, 0, kBlockSize);
+    }
+    ++page->allocated;
+    ++allocated;
+  }
+  return data;
+}
+
+void BlockDevice::release(const lfs_block_t block) {
+  preserve(block);
+  if (base) {
+    shadowed[block] = true;
+  }
+
+  auto& page = pages[block / kPageBlocks];
+  if (!page) {
+    return;
+  }
+
+  const auto index = block % kPageBlocks;
+  auto& data = page->blocks[index];
+  if (!data) {
+    return;
+  }
+
+  if (page->borrowed[index]) {
+    page->borrowed[index] = false;
+    if (--image_blocks_used == 0) {
+      free(image);
+      image = nullptr;
+    }
+  } else if (spare.size() < kMaxSpareBlocks) {
+    spare.emplace_back(data);
+  } else {
+    delete[] data;
+  }
+  data = nullptr;
+
+  --allocated;
+  if (--page->allocated == 0) {
+    page.reset();
+  }
+}
+
+void BlockDevice::release_all() {
+  for (lfs_block_t block = 0; block < block_count; ++block) {
+    release(block);
+  }
+  allocated_after_trim = 0;
+}
+
+int BlockDevice::reclaim(lfs_t* lfs) {
+  if (allocated < allocated_after_trim + kReclaimSlack) {
+    return LFS_ERR_OK;
+  }
+  return trim(lfs);
+}
+
+int BlockDevice::trim(lfs_t* lfs) {
+  std::vector<bool> in_use(block_count);
+  const auto rc = lfs_fs_traverse(
+      lfs,
+      [](void* data, lfs_block_t block) {
+        (*static_cast<std::vector<bool>*>(data))[block] = true;
+        return 0;
+      },
+      &in_use);
+  if (rc < 0) {
+    return rc;
+  }
+
+  for (lfs_block_t block = 0; block < block_count; ++block) {
+    if (!pages[block / kPageBlocks]) {
+      block = (block / kPageBlocks + 1) * kPageBlocks - 1;
+      continue;
+    }
+    if (!in_use[block]) {
+      release(block);
+    }
+  }
+  allocated_after_trim = allocated;
+  return LFS_ERR_OK;
+}
+
+int BlockDevice::load_image(uint8_t* data, const std::size_t size) {
+  ImageHeader header;
+  if (size < sizeof(header)) {
+    free(data);
+    return LFS_ERR_INVAL;
+  }
+  memcpy(&header, data, sizeof(header));
+
+  const auto ids_size = std::size_t{header.image_blocks} * sizeof(uint32_t);
+  const auto blocks_size = std::size_t{header.image_blocks} * kBlockSize;
+  if (header.magic != kImageMagic || header.version != kImageVersion ||
+      header.block_size != kBlockSize || header.block_count != block_count ||
+      size != sizeof(header) + ids_size + blocks_size) {
+    free(data);
+    return LFS_ERR_INVAL;
+  }
+
+  tracking = false;
+  saved.clear();
+  base = false;
+  shadowed.clear();
+  release_all();
+  free(image);
+  image = data;
+  image_blocks_used = 0;
+
+  const auto* ids = data + sizeof(header);
+  auto* blocks = data + sizeof(header) + ids_size;
+  for (uint32_t i = 0; i < header.image_blocks; ++i) {
+    uint32_t block;
+    memcpy(&block, ids + i * sizeof(block), sizeof(block));
+    if (block >= block_count || lookup(block)) {
+      release_all();
+      free(image);
+      image = nullptr;
+      return LFS_ERR_CORRUPT;
+    }
+
+    auto& page = pages[block / kPageBlocks];
+    if (!page) {
+      page = std::make_unique<Page>();
+    }
+    const auto index = block % kPageBlocks;
+    page->blocks[index] = blocks + std::size_t{i} * kBlockSize;
+    page->borrowed[index] = true;
+    ++page->allocated;
+    ++allocated;
+    ++image_blocks_used;
+  }
+
+  allocated_after_trim = allocated;
+  return LFS_ERR_OK;
+}
+
+uint8_t* BlockDevice::save_image(std::size_t* size) const {
+  // blocks only present in the base image are collected first, there is no
+  // cheaper way to tell which blocks it contains
+  std::vector<lfs_block_t> base_blocks;
+  if (base) {
+    auto buffer = std::make_unique<uint8_t[]>(1);
+    for (lfs_block_t block = 0; block < block_count; ++block) {
+      if (!lookup(block) && read_base(block, 0, buffer.get(), 1)) {
+        base_blocks.push_back(block);
+      }
+    }
+  }
+
+  const auto image_blocks = allocated + base_blocks.size();
+  const ImageHeader header = {
+      .magic = kImageMagic,
+      .version = kImageVersion,
+      .block_size = kBlockSize,
+      .block_count = block_count,
+      .image_blocks = static_cast<uint32_t>(image_blocks),
+  };
+  const auto ids_size = image_blocks * sizeof(uint32_t);
+  *size = sizeof(header) + ids_size + image_blocks * kBlockSize;
+
+  auto* result = static_cast<uint8_t*>(malloc(*size));
+  if (!result) {
+    return nullptr;
+  }
+  memcpy(result, &header, sizeof(header));
+
+  auto* ids = result + sizeof(header);
+  auto* blocks = ids + ids_size;
+  auto next_base = base_blocks.begin();
+  for (lfs_block_t block = 0; block < block_count; ++block) {
+    if (const auto* data = lookup(block)) {
+      memcpy(blocks, data, kBlockSize);
+    } else if (next_base != base_blocks.end() && *next_base == block) {
+      read_base(block, 0, blocks, kBlockSize);
+      ++next_base;
+    } else {
+      continue;
+    }
+    memcpy(ids, &block, sizeof(block));
+    ids += sizeof(block);
+    blocks += kBlockSize;
+  }
+  return result;
+}
+
+void BlockDevice::attach_base() {
+  tracking = false;
+  saved.clear();
+  release_all();
+
+  base = true;
+  shadowed.assign(block_count, false);
+}
+
+bool BlockDevice::read_base(const lfs_block_t block, const lfs_off_t off,
+                            void* buffer, const lfs_size_t size) const {
+  if (!base || shadowed[block]) {
+    return false;
+  }
+  return base_read(block, off, reinterpret_cast<int32_t>(buffer), size) != 0;
+}
+
+void BlockDevice::checkpoint() {
+  saved.clear();
+  tracking = true;
+  allocated_after_trim_at_checkpoint = allocated_after_trim;
+}
+
+void BlockDevice::preserve(const lfs_block_t block) {
+  if (!tracking || saved.contains(block)) {
+    return;
+  }
+
+  SavedBlock entry;
+  if (const auto* data = lookup(block)) {
+    entry.data.reset(new uint8_t[kBlockSize]);
+    memcpy(entry.data.get(), data, kBlockSize);
+  }
+  entry.shadowed = base && shadowed[block];
+  saved.emplace(block, std::move(entry));
+}
+
+void BlockDevice::restore() {
+  REQUIRE(tracking);
+
+  tracking = false;
+  for (auto& [block, entry] : saved) {
+    if (entry.data) {
+      memcpy(materialize(block), entry.data.get(), kBlockSize);
+      if (spare.size() < kMaxSpareBlocks) {
+        spare.push_back(std::move(entry.data));
+      }
+    } else {
+      release(block);
+    }
+    if (base) {
+      shadowed[block] = entry.shadowed;
+    }
+  }
+  saved.clear();
+  tracking = true;
+
+  allocated_after_trim = allocated_after_trim_at_checkpoint;
+}
+
+int BlockDevice::read(const struct lfs_config* c, const lfs_block_t block,
+                      const lfs_off_t off, void* buffer,
+                      const lfs_size_t size) {
+  auto& bd = from_config(c);
+  REQUIRE(block < bd.block_count);
+  REQUIRE(off + size <= kBlockSize);
+  ++bd.counters.reads;
+  bd.counters.read_bytes += size;
+
+  const auto* data = bd.lookup(block);
+  if (data) {
+    memcpy(buffer, data + off, size);
+  } else if (bd.read_base(block, off, buffer, size)) {
+    ++bd.counters.base_reads;
+  } else {
+    // never programmed since the last erase
+    memset(buffer, 0, size);
+  }
+  return LFS_ERR_OK;
+}
+
+int BlockDevice::prog(const struct lfs_config* c, const lfs_block_t block,
+                      const lfs_off_t off, const void* buffer,
+                      const lfs_size_t size) {
+  auto& bd = from_config(c);
+  REQUIRE(block < bd.block_count);
+  REQUIRE(off + size <= kBlockSize);
+  ++bd.counters.progs;
+  bd.counters.prog_bytes += size;
+
+  bd.preserve(block);
+  const auto copy_base = !bd.lookup(block);
+  auto* data = bd.materialize(block);
+  if (copy_base) {
+    // littlefs appends commits to metadata blocks without erasing them
+    // first, keep the part of the block that came from the base image
+    bd.read_base(block, 0, data, kBlockSize);
+  }
+  memcpy(data + off, buffer, size);
+  return LFS_ERR_OK;
+}
+
+int BlockDevice::erase(const struct lfs_config* c, const lfs_block_t block) {
+  auto& bd = from_config(c);
+  REQUIRE(block < bd.block_count);
+  ++bd.counters.erases;
+
+  bd.release(block);
+  return LFS_ERR_OK;
+}
+
+int BlockDevice::sync(const struct lfs_config*) { return LFS_ERR_OK; }
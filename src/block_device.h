@@ -0,0 +1,160 @@
+#pragma once
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "lfs.h"
+
+// Layout of a prebuilt filesystem image:
+//
+//   ImageHeader
+//   uint32_t block_ids[image_blocks]
+//   uint8_t  blocks[image_blocks][block_size]
+//
+// All fields are little-endian.
+struct ImageHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  // block count littlefs was formatted with
+  uint32_t block_count;
+  // number of blocks stored in the image
+  uint32_t image_blocks;
+};
+
+// littlefs block device backed by lazily allocated memory. Blocks are only
+// materialized when littlefs programs them and are released again when they
+// are erased or no longer referenced, so the advertised capacity can be far
+// larger than what an instance actually touches.
+//
+// Optionally the device is an overlay over a read-only base image that lives
+// outside of memfs memory and is shared between instances. Blocks are copied
+// from the base the first time they are programmed, an erased block hides
+// the base block for good.
+class BlockDevice {
+ public:
+  static constexpr lfs_size_t kBlockSize = 4096;
+  // 256 MiB of addressable space
+  static constexpr lfs_size_t kDefaultBlockCount = 65536;
+
+  static constexpr uint32_t kImageMagic = 0x49534657;  // "WFSI"
+  static constexpr uint32_t kImageVersion = 1;
+
+  // Calls littlefs made into the device since it was created. littlefs only
+  // reads from the device when its caches miss.
+  struct Stats {
+    uint64_t reads = 0;
+    uint64_t read_bytes = 0;
+    // reads served by the base image
+    uint64_t base_reads = 0;
+    uint64_t progs = 0;
+    uint64_t prog_bytes = 0;
+    uint64_t erases = 0;
+  };
+
+  explicit BlockDevice(lfs_size_t block_count = kDefaultBlockCount);
+  ~BlockDevice();
+
+  lfs_size_t capacity() const { return block_count; }
+  std::size_t blocks_allocated() const { return allocated; }
+  // erased blocks kept for reuse and copies kept for restore()
+  std::size_t blocks_retained() const { return spare.size() + saved.size(); }
+  const Stats& stats() const { return counters; }
+
+  // Releases unreferenced blocks once enough of them may have accumulated
+  // since the last pass, amortizing the filesystem traversal across removes.
+  int reclaim(lfs_t* lfs);
+
+  // Releases every block that is not referenced by the filesystem.
+  int trim(lfs_t* lfs);
+
+  // Replaces the contents of the device with a prebuilt image. The blocks
+  // are used in place rather than copied; ownership of the malloc'd image
+  // passes to the device, even if the image is rejected.
+  int load_image(uint8_t* image, std::size_t size);
+
+  // Replaces the contents of the device with the base image exposed through
+  // the base_read import, which must have been built for block_count.
+  void attach_base();
+  bool has_base() const { return base; }
+
+  // Serializes every allocated block, and the visible blocks of the base
+  // image, into a malloc'd image.
+  uint8_t* save_image(std::size_t* size) const;
+
+  // Marks the current contents as the state restore() returns to. From then
+  // on the original contents of a block are saved the first time it is
+  // programmed or released, loading an image discards the checkpoint.
+  void checkpoint();
+  bool has_checkpoint() const { return tracking; }
+
+  // Returns the blocks modified since the checkpoint to their saved
+  // contents, the cost is proportional to the number of those blocks rather
+  // than to the size of the device. littlefs must not be mounted.
+  void restore();
+
+  static int read(const struct lfs_config* c, lfs_block_t block, lfs_off_t off,
+                  void* buffer, lfs_size_t size);
+  static int prog(const struct lfs_config* c, lfs_block_t block, lfs_off_t off,
+                  const void* buffer, lfs_size_t size);
+  static int erase(const struct lfs_config* c, lfs_block_t block);
+  static int sync(const struct lfs_config* c);
+
+ private:
+  static constexpr lfs_size_t kPageBlocks = 256;
+  // number of blocks allocated since the last trim before reclaim() walks
+  // the filesystem again
+  static constexpr std::size_t kReclaimSlack = 64;
+  // erased blocks kept around for reuse, metadata compaction erases and
+  // reprograms blocks constantly
+  static constexpr std::size_t kMaxSpareBlocks = 16;
+
+  struct Page {
+    uint8_t* blocks[kPageBlocks] = {};
+    // blocks that live inside the loaded image instead of being allocated
+    // individually
+    std::bitset<kPageBlocks> borrowed;
+    lfs_size_t allocated = 0;
+
+    ~Page();
+  };
+
+  uint8_t* lookup(lfs_block_t block) const;
+  uint8_t* materialize(lfs_block_t block);
+  void release(lfs_block_t block);
+  void release_all();
+  void preserve(lfs_block_t block);
+  bool read_base(lfs_block_t block, lfs_off_t off, void* buffer,
+                 lfs_size_t size) const;
+
+  const lfs_size_t block_count;
+  std::vector<std::unique_ptr<Page>> pages;
+  std::vector<std::unique_ptr<uint8_t[]>> spare;
+  std::size_t allocated = 0;
+  std::size_t allocated_after_trim = 0;
+
+  // loaded image and the number of its blocks still in use
+  uint8_t* image = nullptr;
+  std::size_t image_blocks_used = 0;
+
+  bool base = false;
+  // blocks erased since the base was attached, reads no longer fall through
+  // to the base image
+  std::vector<bool> shadowed;
+
+  struct SavedBlock {
+    // null if the block was not allocated
+    std::unique_ptr<uint8_t[]> data;
+    bool shadowed = false;
+  };
+
+  bool tracking = false;
+  std::size_t allocated_after_trim_at_checkpoint = 0;
+  // state of the blocks modified since the checkpoint
+  std::unordered_map<lfs_block_t, SavedBlock> saved;
+
+  Stats counters;
+};
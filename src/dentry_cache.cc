@@ -0,0 +1,28 @@
+#include "dentry_cache.h"
+
+const DentryCache::Entry* DentryCache::find(
+    const std::string_view& path) const {
+  const auto iter = entries.find(path);
+  return iter == entries.end() ? nullptr : &iter->second;
+}
+
+void DentryCache::insert(const std::string_view& path, const Entry& entry) {
+  if (entries.size() >= kMaxEntries) {
+    entries.clear();
+  }
+  entries.insert_or_assign(std::string{path}, entry);
+}
+
+void DentryCache::invalidate(const std::string_view& path) {
+  auto base = path;
+  if (base.size() > 1 && base.back() == '/') {
+    base.remove_suffix(1);
+  }
+  if (const auto iter = entries.find(base); iter != entries.end()) {
+    entries.erase(iter);
+  }
+  if (const auto iter = entries.find(std::string{base} + '/');
+      iter != entries.end()) {
+    entries.erase(iter);
+  }
+}
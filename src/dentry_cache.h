@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "lfs.h"
+#include "util.h"
+
+// Results of looking up canonical paths in littlefs, including lookups that
+// failed. Every lookup otherwise walks the metadata pairs from the root, which
+// adds up when guests probe the same paths over and over (e.g. module search
+// paths). Callers invalidate entries whenever they change what a lookup would
+// return.
+class DentryCache {
+ public:
+  struct Entry {
+    // lfs error of the lookup, LFS_ERR_OK if the path exists
+    int error = LFS_ERR_OK;
+    uint8_t type = 0;
+    lfs_size_t size = 0;
+    // the file is from the lazy manifest and its contents aren't loaded yet
+    bool lazy = false;
+  };
+
+  const Entry* find(const std::string_view& path) const;
+  void insert(const std::string_view& path, const Entry& entry);
+
+  // Drops the entries for `path`, with and without a trailing slash
+  void invalidate(const std::string_view& path);
+  void clear() { entries.clear(); }
+
+ private:
+  // the cache is simply emptied once full, lookups repopulate it quickly
+  static constexpr std::size_t kMaxEntries = 4096;
+
+  std::unordered_map<std::string, Entry, StringHash, std::equal_to<>> entries;
+};
@@ -0,0 +1,96 @@
+#include "fd_table.h"
+
+#include <algorithm>
+#include <functional>
+
+FdTable::Handle FdTable::acquire() {
+  if (pool.empty()) {
+    auto* desc = new FileDescriptor();
+    desc->path.reserve(kInlinePathSize);
+    return Handle(desc, Recycle{this});
+  }
+  auto* desc = pool.back().release();
+  pool.pop_back();
+  return Handle(desc, Recycle{this});
+}
+
+void FdTable::recycle(FileDescriptor* desc) {
+  if (pool.size() >= kMaxPooled) {
+    delete desc;
+    return;
+  }
+  auto path = std::move(desc->path);
+  path.clear();
+  *desc = FileDescriptor{};
+  desc->path = std::move(path);
+  pool.emplace_back(desc);
+}
+
+__wasi_fd_t FdTable::install(Handle desc) {
+  __wasi_fd_t fd;
+  if (free_fds.empty()) {
+    fd = static_cast<__wasi_fd_t>(slots.size());
+    slots.push_back(nullptr);
+  } else {
+    std::pop_heap(free_fds.begin(), free_fds.end(), std::greater<>{});
+    fd = free_fds.back();
+    free_fds.pop_back();
+  }
+  slots[fd] = desc.release();
+  ++open;
+  return fd;
+}
+
+void FdTable::install(const __wasi_fd_t fd, Handle desc) {
+  REQUIRE(!find(fd));
+  if (fd < slots.size()) {
+    std::erase(free_fds, fd);
+    std::make_heap(free_fds.begin(), free_fds.end(), std::greater<>{});
+  } else {
+    for (auto unused = static_cast<__wasi_fd_t>(slots.size()); unused < fd;
+         ++unused) {
+      free_fds.push_back(unused);
+      std::push_heap(free_fds.begin(), free_fds.end(), std::greater<>{});
+    }
+    slots.resize(fd + 1);
+  }
+  slots[fd] = desc.release();
+  ++open;
+}
+
+void FdTable::erase(const __wasi_fd_t fd) {
+  auto* desc = find(fd);
+  REQUIRE(desc);
+  recycle(desc);
+  slots[fd] = nullptr;
+  --open;
+  free_fds.push_back(fd);
+  std::push_heap(free_fds.begin(), free_fds.end(), std::greater<>{});
+}
+
+void FdTable::renumber(const __wasi_fd_t from, const __wasi_fd_t to) {
+  REQUIRE(find(from));
+  if (from == to) {
+    return;
+  }
+  if (find(to)) {
+    erase(to);
+  }
+  Handle desc(slots[from], Recycle{this});
+  slots[from] = nullptr;
+  --open;
+  free_fds.push_back(from);
+  std::push_heap(free_fds.begin(), free_fds.end(), std::greater<>{});
+  install(to, std::move(desc));
+}
+
+void FdTable::clear() {
+  for (auto* desc : slots) {
+    if (desc) {
+      recycle(desc);
+    }
+  }
+  slots.clear();
+  free_fds.clear();
+  open = 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <wasi/api.h>
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "lfs.h"
+
+struct FileDescriptor {
+  std::string path;
+  __wasi_rights_t rights_base = 0;
+  __wasi_rights_t rights_inheriting = 0;
+  __wasi_fdflags_t fd_flags = 0;
+  lfs_type type{};
+  bool stream = false;
+  // bytes written through this descriptor since it was last synced, only
+  // used in write-back mode
+  lfs_size_t dirty_bytes = 0;
+  // the guest's file position, positional I/O moves the littlefs position
+  // without restoring it, see Context::position
+  lfs_off_t pos = 0;
+
+  // fd_readdir cursor, the cookie of the next entry and that entry if it
+  // was already read from littlefs but didn't fit into the last buffer. A
+  // call continuing from this cookie doesn't need to seek.
+  __wasi_dircookie_t dir_cookie = 0;
+  std::optional<lfs_info> dir_pending;
+  // whether state.dir was opened, preopens open it on their first
+  // fd_readdir
+  bool dir_open = false;
+
+  union State {
+    lfs_file_t file;
+    lfs_dir_t dir;
+  } state;
+
+  lfs_file_t& file() {
+    REQUIRE(type == LFS_TYPE_REG);
+    REQUIRE(!stream);
+    return state.file;
+  }
+  lfs_dir_t& dir() {
+    REQUIRE(type == LFS_TYPE_DIR);
+    REQUIRE(!stream);
+    return state.dir;
+  }
+};
+
+// Descriptor table indexed by fd number. Closed numbers go onto a free list
+// and are handed out again first, so numbers stay small and dense and a
+// lookup is an index into the slab.
+//
+// Descriptors come from a pool and keep their address while they are open,
+// littlefs links open files into a list. A recycled descriptor keeps the
+// capacity of its path, so reopening doesn't allocate for paths up to
+// kInlinePathSize bytes, or any path that fit before.
+class FdTable {
+ public:
+  struct Recycle {
+    FdTable* table;
+    void operator()(FileDescriptor* desc) const { table->recycle(desc); }
+  };
+  // descriptor that goes back to the pool unless it is installed
+  using Handle = std::unique_ptr<FileDescriptor, Recycle>;
+
+  FdTable() = default;
+  FdTable(const FdTable&) = delete;
+  FdTable& operator=(const FdTable&) = delete;
+  ~FdTable() { clear(); }
+
+  // Returns a descriptor in its default state
+  Handle acquire();
+
+  // Installs `desc` under the lowest free number and returns that number
+  __wasi_fd_t install(Handle desc);
+  // Installs `desc` under `fd`, which must not be in use
+  void install(__wasi_fd_t fd, Handle desc);
+
+  FileDescriptor* find(const __wasi_fd_t fd) const {
+    return fd < slots.size() ? slots[fd] : nullptr;
+  }
+
+  // Returns the descriptor of `fd` to the pool
+  void erase(__wasi_fd_t fd);
+  // Moves the descriptor of `from` to `to`, recycling whatever `to` held
+  void renumber(__wasi_fd_t from, __wasi_fd_t to);
+  // Returns every descriptor to the pool
+  void clear();
+  bool empty() const { return open == 0; }
+
+  // Calls `fn(fd, desc)` for every open descriptor
+  template <typename Fn>
+  void for_each(Fn&& fn) {
+    for (std::size_t fd = 0; fd < slots.size(); ++fd) {
+      if (slots[fd]) {
+        fn(static_cast<__wasi_fd_t>(fd), *slots[fd]);
+      }
+    }
+  }
+
+ private:
+  static constexpr std::size_t kInlinePathSize = 64;
+  // closed descriptors kept for reuse, more than this are freed
+  static constexpr std::size_t kMaxPooled = 256;
+
+  void recycle(FileDescriptor* desc);
+
+  std::vector<FileDescriptor*> slots;
+  // min-heap of the unused numbers below slots.size()
+  std::vector<__wasi_fd_t> free_fds;
+  std::size_t open = 0;
+  std::vector<std::unique_ptr<FileDescriptor>> pool;
+};
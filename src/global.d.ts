@@ -15,7 +15,21 @@ declare namespace WebAssembly {
     new (module: Module, importObject?: Imports): Instance
   }
 
-  type ImportValue = ExportValue | number
+  // JavaScript Promise Integration, not every engine supports it yet
+  interface Suspending {}
+
+  var Suspending:
+    | {
+        prototype: Suspending
+        new (fn: Function): Suspending
+      }
+    | undefined
+
+  var promising:
+    | ((fn: Function) => (...args: any[]) => Promise<any>)
+    | undefined
+
+  type ImportValue = ExportValue | Suspending | number
   type ModuleImports = Record<string, ImportValue>
   type Imports = Record<string, ModuleImports>
   type ExportValue = Function | Memory
@@ -1,8 +1,19 @@
 export { traceImportsToConsole } from './helpers'
 import * as wasi from './snapshot_preview1'
-import { MemFS, _FS } from './memfs'
+import {
+  FSLoader,
+  FSManifest,
+  MemFS,
+  MemFSPool,
+  MemFSPoolOptions,
+  MemFSStats,
+  SyncMode,
+  _FS,
+} from './memfs'
 // @ts-ignore
 import { Asyncify } from '../deps/asyncify/asyncify.mjs'
+import { ImportMetrics, Metrics, WASIMetrics } from './metrics'
+import { TraceRecorder } from './trace'
 import {
   FileDescriptor,
   fromReadableStream,
@@ -11,6 +22,16 @@ import {
 
 export type Environment = { [key: string]: string }
 
+/**
+ * How the application is suspended while it waits for asynchronous I/O, see {@link WASIOptions.streamStdioBackend}
+ * @public
+ */
+export type StreamStdioBackend = 'auto' | 'jspi' | 'asyncify'
+
+const supportsJSPI = (): boolean =>
+  typeof WebAssembly.Suspending === 'function' &&
+  typeof WebAssembly.promising === 'function'
+
 /**
  * ProcessExit is thrown when `proc_exit` is called
  * @public
@@ -72,6 +93,16 @@ export interface WASIOptions {
    */
   stdin?: ReadableStream
 
+  /**
+   * Without {@link WASIOptions.streamStdio} stdin is received in full before the application starts. Once more than
+   * this many bytes were buffered, the rest of it is kept in the in-memory filesystem's block store instead of on the
+   * JavaScript heap. The spooled data isn't visible to the application as a file.
+   *
+   * @defaultValue `undefined`, stdin is kept on the heap
+   *
+   */
+  stdinSpillThreshold?: number
+
   /**
    * Output stream that the application will be able to write to via stdin
    */
@@ -83,7 +114,9 @@ export interface WASIOptions {
   stderr?: WritableStream
 
   /**
-   * Enable async IO for stdio streams, requires the application is built with {@link asyncify|https://web.dev/asyncify/}
+   * Enable async IO for stdio streams, requires the engine supports
+   * {@link JavaScript Promise Integration|https://github.com/WebAssembly/js-promise-integration} or the application is
+   * built with {@link asyncify|https://web.dev/asyncify/}
    *
    * @experimental
    * @defaultValue `false`
@@ -91,6 +124,112 @@ export interface WASIOptions {
    */
   streamStdio?: boolean
 
+  /**
+   * With {@link WASIOptions.streamStdio}, how the application is suspended while it waits for a stream. `'jspi'` uses
+   * `WebAssembly.Suspending` and `WebAssembly.promising` and works with unmodified modules, `'asyncify'` requires the
+   * module is built with asyncify. `'auto'` uses JSPI if the engine supports it and asyncify otherwise.
+   *
+   * @experimental
+   * @defaultValue `'auto'`
+   *
+   */
+  streamStdioBackend?: StreamStdioBackend
+
+  /**
+   * With {@link WASIOptions.streamStdio}, number of bytes of stdout and stderr output that are buffered before the
+   * application is suspended to wait for backpressure on the stream to clear. Writes below it return without
+   * suspending, buffered output is written once the application yields or exits. `0` suspends the application until
+   * every write completed, regardless of backpressure.
+   *
+   * @defaultValue `65536`
+   *
+   */
+  streamStdioHighWaterMark?: number
+
+  /**
+   * With {@link WASIOptions.streamStdio}, number of bytes of stdin that are read ahead of the application. Reads are
+   * answered from this buffer without suspending the application, it is only suspended once the buffer ran dry. `0`
+   * reads from the stream on demand.
+   *
+   * @defaultValue `65536`
+   *
+   */
+  streamStdioReadahead?: number
+
+  /**
+   * Collect per-import call counts, errors, bytes moved and latency histograms, and split the time of
+   * {@link WASI.start} between the application, the imports and the filesystem. The overhead is a clock read before
+   * and after every call. Read them from {@link WASI.metrics} once the application exited. On Workers the clock only
+   * advances on I/O, so only time spent waiting is visible.
+   *
+   * @defaultValue `false`
+   *
+   */
+  metrics?: boolean
+
+  /**
+   * Appends every import call with its arguments, the paths and iovec sizes it was passed, its result and a timestamp
+   * to the recorder's ring buffer. Unlike {@link traceImportsToConsole} nothing is formatted while the application
+   * runs. Save the trace with {@link TraceRecorder.save} and replay the filesystem calls in it with
+   * `tools/replay.mjs`.
+   *
+   * @defaultValue `undefined`
+   *
+   */
+  trace?: TraceRecorder
+
+  /**
+   * When file writes are committed to the in-memory filesystem. `'strict'` commits on every read and write,
+   * `'write-back'` defers commits until `fd_sync`, `fd_datasync`, `fd_close`, a path based operation, the end of
+   * {@link WASI.start} or until {@link WASIOptions.fsDirtyThreshold} bytes were written through a file descriptor.
+   *
+   * @defaultValue `'strict'`
+   *
+   */
+  fsSyncMode?: SyncMode
+
+  /**
+   * Number of bytes written through a file descriptor before it is committed in `'write-back'` mode
+   *
+   * @defaultValue `1048576`
+   *
+   */
+  fsDirtyThreshold?: number
+
+  /**
+   * Prebuilt filesystem image, see `tools/mkimage.mjs`. The image is installed with a single copy before any
+   * {@link WASIOptions.fs} contents are written on top of it.
+   *
+   */
+  fsImage?: Uint8Array
+
+  /**
+   * Filesystem image shared as a read-only base layer, see `tools/mkimage.mjs`. Unlike {@link WASIOptions.fsImage}
+   * nothing is copied up front, instances only hold the blocks they modify. The image is indexed once and reused for
+   * every instance constructed with the same `Uint8Array`. Mutually exclusive with {@link WASIOptions.fsImage}.
+   *
+   */
+  fsBaseImage?: Uint8Array
+
+  /**
+   * Files that are listed and can be stat'ed up front but whose contents are only requested from
+   * {@link WASIOptions.fsLoader} when they are first opened
+   *
+   */
+  fsManifest?: FSManifest
+
+  /**
+   * Provides the contents of {@link WASIOptions.fsManifest} files, required if a manifest is given
+   *
+   */
+  fsLoader?: FSLoader
+
+  /**
+   * Filesystem from a {@link MemFSPool}, when set the `preopens` and `fs*` options are taken from the pool instead
+   *
+   */
+  memfs?: MemFS
+
   /**
    * Initial filesystem contents, currently used for testing with
    * existing WASI test suites
@@ -112,8 +251,14 @@ export class WASI {
   #streams: Array<FileDescriptor>
 
   #memfs: MemFS
+  // memfs exports called by the imports, timed in metrics mode
+  #fs: wasi.SnapshotPreview1
+  #metrics?: Metrics
+  #trace?: TraceRecorder
   #state: any = new Asyncify()
-  #asyncify: boolean
+  #streamStdio: boolean
+  // how the application is suspended with streamStdio
+  #backend?: 'jspi' | 'asyncify'
 
   constructor(options?: WASIOptions) {
     this.#args = options?.args ?? []
@@ -125,13 +270,57 @@ export class WASI {
     this.#returnOnExit = options?.returnOnExit ?? false
     this.#preopens = options?.preopens ?? []
 
-    this.#asyncify = options?.streamStdio ?? false
+    this.#streamStdio = options?.streamStdio ?? false
+    if (this.#streamStdio) {
+      const backend = options?.streamStdioBackend ?? 'auto'
+      if (backend === 'jspi' && !supportsJSPI()) {
+        throw new Error(
+          "streamStdioBackend 'jspi' is requested but the engine doesn't support WebAssembly.Suspending"
+        )
+      }
+      this.#backend =
+        backend === 'auto' ? (supportsJSPI() ? 'jspi' : 'asyncify') : backend
+    }
+    this.#memfs =
+      options?.memfs ??
+      new MemFS(this.#preopens, options?.fs ?? {}, {
+        syncMode: options?.fsSyncMode,
+        dirtyThreshold: options?.fsDirtyThreshold,
+        image: options?.fsImage,
+        baseImage: options?.fsBaseImage,
+        manifest: options?.fsManifest,
+        loader: options?.fsLoader,
+      })
+
+    if (options?.metrics) {
+      this.#metrics = new Metrics()
+    }
+    this.#trace = options?.trace
+    this.#fs = this.#metrics
+      ? this.#metrics.wrapMemFS(this.#memfs.exports)
+      : this.#memfs.exports
+
+    const spillThreshold = options?.stdinSpillThreshold
     this.#streams = [
-      fromReadableStream(options?.stdin, this.#asyncify),
-      fromWritableStream(options?.stdout, this.#asyncify),
-      fromWritableStream(options?.stderr, this.#asyncify),
+      fromReadableStream(
+        options?.stdin,
+        this.#streamStdio,
+        spillThreshold === undefined
+          ? undefined
+          : { memfs: this.#memfs, threshold: spillThreshold },
+        options?.streamStdioReadahead
+      ),
+      fromWritableStream(
+        options?.stdout,
+        this.#streamStdio,
+        options?.streamStdioHighWaterMark
+      ),
+      fromWritableStream(
+        options?.stderr,
+        this.#streamStdio,
+        options?.streamStdioHighWaterMark
+      ),
     ]
-    this.#memfs = new MemFS(this.#preopens, options?.fs ?? {})
   }
 
   /**
@@ -147,8 +336,9 @@ export class WASI {
     this.#memory = instance.exports.memory as WebAssembly.Memory
     this.#memfs.initialize(this.#memory)
 
+    this.#metrics?.begin()
     try {
-      if (this.#asyncify) {
+      if (this.#backend === 'asyncify') {
         if (!instance.exports.asyncify_get_state) {
           throw new Error(
             "streamStdio is requested but the module is missing 'Asyncify' exports, see https://github.com/GoogleChromeLabs/asyncify"
@@ -159,7 +349,11 @@ export class WASI {
       }
 
       await Promise.all(this.#streams.map((s) => s.preRun()))
-      if (this.#asyncify) {
+      if (this.#backend === 'jspi') {
+        // the application is suspended whenever an import returns a
+        // promise, _start runs on its own stack until it returns
+        await WebAssembly.promising!(instance.exports._start as Function)()
+      } else if (this.#backend === 'asyncify') {
         await this.#state.exports._start()
       } else {
         const entrypoint = instance.exports._start as Function
@@ -178,6 +372,9 @@ export class WASI {
         throw e
       }
     } finally {
+      this.#metrics?.end()
+      this.#memfs.flush()
+
       // We must call close to avoid early termination due to hanging promise
       await Promise.all(this.#streams.map((s) => s.close()))
       await Promise.all(this.#streams.map((s) => s.postRun()))
@@ -185,64 +382,100 @@ export class WASI {
     return undefined
   }
 
+  /**
+   * Creates or replaces a file in the filesystem. Unlike {@link WASIOptions.fs} contents are binary and are streamed
+   * into the filesystem in bounded chunks.
+   *
+   */
+  addFile(
+    path: string,
+    data: Uint8Array | ReadableStream<Uint8Array>
+  ): Promise<void> {
+    return this.#memfs.addFile(path, data)
+  }
+
+  /**
+   * Statistics of the last {@link WASI.start}, requires {@link WASIOptions.metrics}
+   *
+   */
+  get metrics(): WASIMetrics | undefined {
+    return this.#metrics?.snapshot()
+  }
+
   get wasiImport(): Record<string, Function> {
-    const wrap = (f: any, self: any = this) => {
-      const bound = f.bind(self)
-      if (this.#asyncify) {
-        return this.#state.wrapImportFn(bound)
+    const read = (addr: number) => this.#view().getUint32(addr, true)
+    const wrap = (name: string, f: Function) => {
+      if (this.#trace) {
+        f = this.#trace.wrapImport(name, f, () => this.#view())
+      }
+      if (this.#metrics) {
+        f = this.#metrics.wrapImport(name, f, read)
       }
-      return bound
+      if (this.#backend === 'jspi') {
+        // imports that return a value instead of a promise don't suspend,
+        // the wrapper is only usable as an import rather than from JavaScript
+        return new WebAssembly.Suspending!(f) as unknown as Function
+      }
+      if (this.#backend === 'asyncify') {
+        return this.#state.wrapImportFn(f)
+      }
+      return f
     }
-
-    return {
-      args_get: wrap(this.#args_get),
-      args_sizes_get: wrap(this.#args_sizes_get),
-      clock_res_get: wrap(this.#clock_res_get),
-      clock_time_get: wrap(this.#clock_time_get),
-      environ_get: wrap(this.#environ_get),
-      environ_sizes_get: wrap(this.#environ_sizes_get),
-      fd_advise: wrap(this.#memfs.exports.fd_advise),
-      fd_allocate: wrap(this.#memfs.exports.fd_allocate),
-      fd_close: wrap(this.#memfs.exports.fd_close),
-      fd_datasync: wrap(this.#memfs.exports.fd_datasync),
-      fd_fdstat_get: wrap(this.#memfs.exports.fd_fdstat_get),
-      fd_fdstat_set_flags: wrap(this.#memfs.exports.fd_fdstat_set_flags),
-      fd_fdstat_set_rights: wrap(this.#memfs.exports.fd_fdstat_set_rights),
-      fd_filestat_get: wrap(this.#memfs.exports.fd_filestat_get),
-      fd_filestat_set_size: wrap(this.#memfs.exports.fd_filestat_set_size),
-      fd_filestat_set_times: wrap(this.#memfs.exports.fd_filestat_set_times),
-      fd_pread: wrap(this.#memfs.exports.fd_pread),
-      fd_prestat_dir_name: wrap(this.#memfs.exports.fd_prestat_dir_name),
-      fd_prestat_get: wrap(this.#memfs.exports.fd_prestat_get),
-      fd_pwrite: wrap(this.#memfs.exports.fd_pwrite),
-      fd_read: wrap(this.#fd_read),
-      fd_readdir: wrap(this.#memfs.exports.fd_readdir),
-      fd_renumber: wrap(this.#memfs.exports.fd_renumber),
-      fd_seek: wrap(this.#memfs.exports.fd_seek),
-      fd_sync: wrap(this.#memfs.exports.fd_sync),
-      fd_tell: wrap(this.#memfs.exports.fd_tell),
-      fd_write: wrap(this.#fd_write),
-      path_create_directory: wrap(this.#memfs.exports.path_create_directory),
-      path_filestat_get: wrap(this.#memfs.exports.path_filestat_get),
-      path_filestat_set_times: wrap(
-        this.#memfs.exports.path_filestat_set_times
+    const bind = (f: any) => f.bind(this)
+
+    const imports: Record<string, Function> = {
+      args_get: bind(this.#args_get),
+      args_sizes_get: bind(this.#args_sizes_get),
+      clock_res_get: bind(this.#clock_res_get),
+      clock_time_get: bind(this.#clock_time_get),
+      environ_get: bind(this.#environ_get),
+      environ_sizes_get: bind(this.#environ_sizes_get),
+      fd_advise: bind(this.#fs.fd_advise),
+      fd_allocate: bind(this.#fs.fd_allocate),
+      fd_close: bind(this.#fs.fd_close),
+      fd_datasync: bind(this.#fs.fd_datasync),
+      fd_fdstat_get: bind(this.#fs.fd_fdstat_get),
+      fd_fdstat_set_flags: bind(this.#fs.fd_fdstat_set_flags),
+      fd_fdstat_set_rights: bind(this.#fs.fd_fdstat_set_rights),
+      fd_filestat_get: bind(this.#fs.fd_filestat_get),
+      fd_filestat_set_size: bind(this.#fs.fd_filestat_set_size),
+      fd_filestat_set_times: bind(this.#fs.fd_filestat_set_times),
+      fd_pread: bind(this.#fs.fd_pread),
+      fd_prestat_dir_name: bind(this.#fs.fd_prestat_dir_name),
+      fd_prestat_get: bind(this.#fs.fd_prestat_get),
+      fd_pwrite: bind(this.#fs.fd_pwrite),
+      fd_read: bind(this.#fd_read),
+      fd_readdir: bind(this.#fs.fd_readdir),
+      fd_renumber: bind(this.#fs.fd_renumber),
+      fd_seek: bind(this.#fs.fd_seek),
+      fd_sync: bind(this.#fs.fd_sync),
+      fd_tell: bind(this.#fs.fd_tell),
+      fd_write: bind(this.#fd_write),
+      path_create_directory: bind(this.#fs.path_create_directory),
+      path_filestat_get: bind(this.#fs.path_filestat_get),
+      path_filestat_set_times: bind(
+        this.#fs.path_filestat_set_times
       ),
-      path_link: wrap(this.#memfs.exports.path_link),
-      path_open: wrap(this.#memfs.exports.path_open),
-      path_readlink: wrap(this.#memfs.exports.path_readlink),
-      path_remove_directory: wrap(this.#memfs.exports.path_remove_directory),
-      path_rename: wrap(this.#memfs.exports.path_rename),
-      path_symlink: wrap(this.#memfs.exports.path_symlink),
-      path_unlink_file: wrap(this.#memfs.exports.path_unlink_file),
-      poll_oneoff: wrap(this.#poll_oneoff),
-      proc_exit: wrap(this.#proc_exit),
-      proc_raise: wrap(this.#proc_raise),
-      random_get: wrap(this.#random_get),
-      sched_yield: wrap(this.#sched_yield),
-      sock_recv: wrap(this.#sock_recv),
-      sock_send: wrap(this.#sock_send),
-      sock_shutdown: wrap(this.#sock_shutdown),
+      path_link: bind(this.#fs.path_link),
+      path_open: bind(this.#fs.path_open),
+      path_readlink: bind(this.#fs.path_readlink),
+      path_remove_directory: bind(this.#fs.path_remove_directory),
+      path_rename: bind(this.#fs.path_rename),
+      path_symlink: bind(this.#fs.path_symlink),
+      path_unlink_file: bind(this.#fs.path_unlink_file),
+      poll_oneoff: bind(this.#poll_oneoff),
+      proc_exit: bind(this.#proc_exit),
+      proc_raise: bind(this.#proc_raise),
+      random_get: bind(this.#random_get),
+      sched_yield: bind(this.#sched_yield),
+      sock_recv: bind(this.#sock_recv),
+      sock_send: bind(this.#sock_send),
+      sock_shutdown: bind(this.#sock_shutdown),
     }
+    for (const [name, f] of Object.entries(imports)) {
+      imports[name] = wrap(name, f)
+    }
+    return imports
   }
 
   #view(): DataView {
@@ -354,7 +587,7 @@ export class WASI {
         return wasi.Result.SUCCESS
       })
     }
-    return this.#memfs.exports.fd_read(fd, iovs_ptr, iovs_len, retptr0)
+    return this.#fs.fd_read(fd, iovs_ptr, iovs_len, retptr0)
   }
 
   #fd_write(
@@ -378,7 +611,7 @@ export class WASI {
         return wasi.Result.SUCCESS
       })
     }
-    return this.#memfs.exports.fd_write(fd, ciovs_ptr, ciovs_len, retptr0)
+    return this.#fs.fd_write(fd, ciovs_ptr, ciovs_len, retptr0)
   }
 
   #poll_oneoff(
@@ -434,4 +667,14 @@ export class WASI {
   }
 }
 
-export type { _FS }
+export { MemFS, MemFSPool, TraceRecorder }
+export type {
+  _FS,
+  FSLoader,
+  FSManifest,
+  ImportMetrics,
+  MemFSPoolOptions,
+  MemFSStats,
+  SyncMode,
+  WASIMetrics,
+}
@@ -0,0 +1,87 @@
+#include "inode_table.h"
+
+#include <vector>
+
+std::string_view InodeTable::key(std::string_view path) {
+  // "/dir/" and "/dir" are the same directory
+  if (path.size() > 1 && path.back() == '/') {
+    path.remove_suffix(1);
+  }
+  return path;
+}
+
+__wasi_inode_t InodeTable::derive(const std::string_view k) const {
+  // 64-bit FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (const char c : k) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  while (hash == 0 || used.contains(hash)) {
+    ++hash;
+  }
+  return hash;
+}
+
+InodeTable::Inode& InodeTable::get(const std::string_view path) {
+  const auto k = key(path);
+  if (const auto iter = inodes.find(k); iter != inodes.end()) {
+    return iter->second;
+  }
+  const auto ino = derive(k);
+  auto& inode = inodes[std::string{k}];
+  inode.ino = ino;
+  used.insert(ino);
+  return inode;
+}
+
+InodeTable::Inode* InodeTable::find(const std::string_view path) {
+  const auto iter = inodes.find(key(path));
+  return iter == inodes.end() ? nullptr : &iter->second;
+}
+
+__wasi_inode_t InodeTable::ino(const std::string_view path) const {
+  const auto k = key(path);
+  const auto iter = inodes.find(k);
+  return iter == inodes.end() ? derive(k) : iter->second.ino;
+}
+
+void InodeTable::remove(const std::string_view path) {
+  if (const auto iter = inodes.find(key(path)); iter != inodes.end()) {
+    used.erase(iter->second.ino);
+    inodes.erase(iter);
+  }
+}
+
+void InodeTable::rename(const std::string_view from,
+                        const std::string_view to) {
+  const std::string old_prefix{key(from)};
+  const std::string new_prefix{key(to)};
+  const auto is_below = [](const std::string& path,
+                           const std::string& prefix) {
+    return path.size() > prefix.size() && path.starts_with(prefix) &&
+           path[prefix.size()] == '/';
+  };
+
+  // whatever was at the destination is replaced
+  std::erase_if(inodes, [&](const auto& entry) {
+    if (entry.first != new_prefix && !is_below(entry.first, new_prefix)) {
+      return false;
+    }
+    used.erase(entry.second.ino);
+    return true;
+  });
+
+  std::vector<std::pair<std::string, Inode>> moved;
+  std::erase_if(inodes, [&](const auto& entry) {
+    if (entry.first != old_prefix && !is_below(entry.first, old_prefix)) {
+      return false;
+    }
+    moved.emplace_back(new_prefix + entry.first.substr(old_prefix.size()),
+                       entry.second);
+    return true;
+  });
+  for (auto& [path, inode] : moved) {
+    inodes.insert_or_assign(std::move(path), inode);
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <wasi/api.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "util.h"
+
+struct FileMetadata {
+  // 100 required for wastime tests
+  __wasi_timestamp_t mtim = 100;
+  __wasi_timestamp_t atim = 100;
+};
+
+// Resident per-file state keyed by canonical path, so that stat and open
+// don't have to read or write littlefs attributes. Entries are created on
+// first use and follow their file across renames.
+//
+// Inode numbers are derived from the path, so a file has the same number
+// before and after it gets an entry and listing a directory doesn't need to
+// create any. A number held by another entry, e.g. one renamed away from the
+// path, is skipped.
+class InodeTable {
+ public:
+  struct Inode {
+    __wasi_inode_t ino = 0;
+    // metadata and nlink are filled in from the filesystem on first access
+    bool loaded = false;
+    // metadata changed since it was last written to the filesystem
+    bool dirty = false;
+    FileMetadata metadata;
+    __wasi_linkcount_t nlink = 1;
+  };
+
+  // Returns the inode of `path`, allocating a new number if it has none
+  Inode& get(std::string_view path);
+  Inode* find(std::string_view path);
+  // Returns the inode number of `path` without creating an entry
+  __wasi_inode_t ino(std::string_view path) const;
+
+  void remove(std::string_view path);
+  // Moves the inodes of `from` and everything below it to `to`, replacing
+  // any inode already at `to`
+  void rename(std::string_view from, std::string_view to);
+  void clear() {
+    inodes.clear();
+    used.clear();
+  }
+
+  auto begin() { return inodes.begin(); }
+  auto end() { return inodes.end(); }
+
+ private:
+  static std::string_view key(std::string_view path);
+  __wasi_inode_t derive(std::string_view key) const;
+
+  std::unordered_map<std::string, Inode, StringHash, std::equal_to<>> inodes;
+  // numbers of the entries in `inodes`
+  std::unordered_set<__wasi_inode_t> used;
+};
@@ -3,13 +3,18 @@
 #include <stdarg.h>
 #include <wasi/api.h>
 
+#include <algorithm>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
-#include "bd/lfs_rambd.h"
+#include "block_device.h"
 #include "config.h"
+#include "dentry_cache.h"
+#include "fd_table.h"
+#include "inode_table.h"
 #include "lfs.h"
+#include "path.h"
 #include "util.h"
 
 void wasi_trace(int error, const char* fmt, ...) {
@@ -72,17 +77,74 @@ __wasi_errno_t from_lfs_error(int error) {
       return __WASI_ERRNO_NOTDIR;
     case LFS_ERR_INVAL:
       return __WASI_ERRNO_INVAL;
+    case LFS_ERR_NOSPC:
+      return __WASI_ERRNO_NOSPC;
+    case LFS_ERR_NOMEM:
+      return __WASI_ERRNO_NOMEM;
+    case LFS_ERR_FBIG:
+      return __WASI_ERRNO_FBIG;
+    case LFS_ERR_NAMETOOLONG:
+      return __WASI_ERRNO_NAMETOOLONG;
+    case LFS_ERR_BADF:
+      return __WASI_ERRNO_BADF;
+    case LFS_ERR_IO:
+    case LFS_ERR_CORRUPT:
+      return __WASI_ERRNO_IO;
   }
   REQUIRE(false);
   return __WASI_ERRNO_SUCCESS;
 }
 
-struct FileMetadata {
-  // 100 required for wastime tests
-  __wasi_timestamp_t mtim = 100;
-  __wasi_timestamp_t atim = 100;
+// littlefs user attributes
+// FileMetadata of a file, only written when an image is saved, see
+// InodeTable
+constexpr uint8_t kMetadataAttr = 1;
+// size of a file from the lazy manifest whose contents have not been loaded
+// yet, the file itself is empty until then
+constexpr uint8_t kLazySizeAttr = 2;
+
+// directory holding the host's spool files, see Context::spool_begin. It is
+// hidden from the guest.
+constexpr std::string_view kSpoolDir = "/.memfs-spool";
+constexpr std::string_view kSpoolName = kSpoolDir.substr(1);
+
+bool is_spool_path(const std::string_view& path) {
+  return path.starts_with(kSpoolDir) &&
+         (path.size() == kSpoolDir.size() || path[kSpoolDir.size()] == '/');
+}
+
+// Whether the entry `name` of the canonical directory `dir` is hidden from
+// the guest
+bool is_hidden_entry(const std::string_view& dir, const char* name) {
+  return dir == "/" && name == kSpoolName;
+}
+
+// Result of the stats export, read by MemFS.stats(). Counters are cumulative
+// since the filesystem was created.
+struct Stats {
+  uint64_t bd_reads;
+  uint64_t bd_read_bytes;
+  uint64_t bd_base_reads;
+  uint64_t bd_progs;
+  uint64_t bd_prog_bytes;
+  uint64_t bd_erases;
+  uint64_t block_count;
+  // blocks referenced by the filesystem
+  uint64_t blocks_in_use;
+  // blocks held in memory, including erased blocks kept for reuse and the
+  // copies kept for a reset
+  uint64_t blocks_allocated;
+  uint64_t blocks_retained;
+  uint64_t memory_bytes;
+  // memory above the static data and stack. Linear memory never shrinks, so
+  // this is how far the heap ever grew, not what is currently allocated
+  uint64_t dynamic_bytes;
 };
 
+#ifdef __wasm__
+extern "C" unsigned char __heap_base;
+#endif
+
 #define RETURN_IF_LFS_ERR(x)       \
   ({                               \
     const auto __rc = (x);         \
@@ -112,31 +174,6 @@ struct FileMetadata {
 #define REQUIRE_FD(fd, rights) REQUIRE_TYPED_FD(fd, 0, rights, false)
 #define REQUIRE_FD_OR_STREAM(fd, rights) REQUIRE_TYPED_FD(fd, 0, rights, true)
 
-struct FileDescriptor {
-  std::string path;
-  __wasi_rights_t rights_base = 0;
-  __wasi_rights_t rights_inheriting = 0;
-  __wasi_fdflags_t fd_flags = 0;
-  lfs_type type{};
-  bool stream = false;
-
-  union State {
-    lfs_file_t file;
-    lfs_dir_t dir;
-  } state;
-
-  lfs_file_t& file() {
-    REQUIRE(type == LFS_TYPE_REG);
-    REQUIRE(!stream);
-    return state.file;
-  }
-  lfs_dir_t& dir() {
-    REQUIRE(type == LFS_TYPE_DIR);
-    REQUIRE(!stream);
-    return state.dir;
-  }
-};
-
 // clang-format off
 constexpr const __wasi_rights_t WASI_PATH_RIGHTS =
     __WASI_RIGHTS_PATH_CREATE_DIRECTORY |
@@ -171,80 +208,250 @@ constexpr const __wasi_rights_t WASI_FD_RIGHTS =
     __WASI_RIGHTS_FD_FILESTAT_SET_TIMES;
 // clang-format on
 
+enum class SyncMode {
+  // commit file state to littlefs on every read and write
+  kStrict,
+  // commit file state on fd_sync/fd_datasync/fd_close, before path
+  // operations and once dirty_threshold bytes have been written
+  kWriteBack,
+};
+
 struct Context {
   lfs_t lfs;
-  int next_fd = 2147483647;
   std::vector<std::string> preopens;
-  std::unordered_map<__wasi_fd_t, std::unique_ptr<FileDescriptor>> fds;
+  FdTable fds;
 
-  struct lfs_rambd rambd {};
+  // files being written by the host through MemFS.addFile or spooled
+  // through MemFS.createSpool, by handle
+  struct Ingest {
+    std::string path;
+    lfs_file_t file;
+    bool spool = false;
+  };
+  std::unordered_map<int32_t, std::unique_ptr<Ingest>> ingests;
+  int32_t next_ingest = 1;
+
+  SyncMode sync_mode = SyncMode::kStrict;
+  lfs_size_t dirty_threshold = 1024 * 1024;
+  std::vector<FileDescriptor*> dirty;
+
+  BlockDevice bd;
+  DentryCache dentries;
+  InodeTable inodes;
+  // state of the inode table when the block device was checkpointed
+  InodeTable inodes_at_checkpoint;
 
   const struct lfs_config cfg = {
-      .context = &rambd,
-      .read = lfs_rambd_read,
-      .prog = lfs_rambd_prog,
-      .erase = lfs_rambd_erase,
-      .sync = lfs_rambd_sync,
+      .context = &bd,
+      .read = BlockDevice::read,
+      .prog = BlockDevice::prog,
+      .erase = BlockDevice::erase,
+      .sync = BlockDevice::sync,
       .read_size = 16,
       .prog_size = 16,
-      .block_size = 4096,
-      .block_count = 128,
+      .block_size = BlockDevice::kBlockSize,
+      .block_count = BlockDevice::kDefaultBlockCount,
       .block_cycles = 500,
       .cache_size = 16,
-      .lookahead_size = 16,
+      // each byte tracks 8 blocks, a larger window means fewer filesystem
+      // traversals by the block allocator when writing large files
+      .lookahead_size = 256,
   };
 
-  __wasi_fd_t allocate_fd() {
-    for (;;) {
-      const auto fd = next_fd--;
-      if (next_fd < preopens.size()) {
-        next_fd = std::numeric_limits<int32_t>::max();
+  __wasi_errno_t filestat_get(const char* path, __wasi_filestat_t* result) {
+    RETURN_IF_WASI_ERR(sync_all());
+
+    DentryCache::Entry entry;
+    RETURN_IF_LFS_ERR(lookup(path, &entry));
+
+    const auto& node = inode(path, entry.type);
+    *result = {.dev = 0,
+               .ino = node.ino,
+               .filetype = from_lfs_type(entry.type),
+               .nlink = node.nlink,
+               .size = entry.size,
+               .atim = node.metadata.atim,
+               .mtim = node.metadata.mtim};
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // lfs_stat through the dentry cache, sizes of files from the lazy manifest
+  // are served from the manifest without loading the file
+  int lookup(const char* path, DentryCache::Entry* result) {
+    if (const auto* cached = dentries.find(path)) {
+      *result = *cached;
+      return result->error;
+    }
+
+    lfs_info info{};
+    DentryCache::Entry entry;
+    entry.error = lfs_stat(&lfs, path, &info);
+    if (entry.error == LFS_ERR_OK) {
+      entry.type = info.type;
+      entry.size = info.size;
+      if (info.type == LFS_TYPE_REG) {
+        entry.lazy = lfs_getattr(&lfs, path, kLazySizeAttr, &entry.size,
+                                 sizeof(entry.size)) == sizeof(entry.size);
       }
+    }
+    dentries.insert(path, entry);
+    *result = entry;
+    return entry.error;
+  }
 
-      if (fds.find(fd) != fds.end()) {
-        continue;
+  // Resident state of `path`, metadata saved in an image and the link count
+  // are read from the filesystem the first time
+  InodeTable::Inode& inode(const char* path, const uint8_t type) {
+    auto& node = inodes.get(path);
+    if (!node.loaded) {
+      FileMetadata m;
+      if (lfs_getattr(&lfs, path, kMetadataAttr, &m, sizeof(m)) == sizeof(m)) {
+        node.metadata = m;
       }
+      node.nlink = type == LFS_TYPE_DIR ? 2 + count_subdirectories(path) : 1;
+      node.loaded = true;
+    }
+    return node;
+  }
 
-      return fd;
+  void adjust_nlink(const std::string_view& path, const int delta) {
+    if (auto* node = inodes.find(path); node && node->loaded) {
+      node->nlink += delta;
     }
   }
 
-  __wasi_errno_t filestat_get(const char* path, __wasi_filestat_t* result) {
-    lfs_info info{};
-    RETURN_IF_LFS_ERR(lfs_stat(&lfs, path, &info));
+  __wasi_linkcount_t count_subdirectories(const char* path) {
+    lfs_dir_t dir;
+    if (lfs_dir_open(&lfs, &dir, path) < 0) {
+      return 0;
+    }
+    __wasi_linkcount_t count = 0;
+    lfs_info info;
+    while (lfs_dir_read(&lfs, &dir, &info) > 0) {
+      if (info.type == LFS_TYPE_DIR && strcmp(info.name, ".") &&
+          strcmp(info.name, "..") && !is_hidden_entry(path, info.name)) {
+        ++count;
+      }
+    }
+    lfs_dir_close(&lfs, &dir);
+    return count;
+  }
 
-    const auto m = get_metadata(path);
-    *result = {.dev = 0,
-               .ino = 0,
-               .filetype = from_lfs_type(info.type),
-               .nlink = 1,
-               .size = info.size,
-               .atim = m.atim,
-               .mtim = m.mtim};
+  // Makes the current state the one reset() returns to
+  void checkpoint() {
+    bd.checkpoint();
+    inodes_at_checkpoint = inodes;
+  }
+
+  // Loads the contents of a file from the lazy manifest through the
+  // lazy_load import, does nothing for any other file. `entry` is the lookup
+  // of `path`, so files that were looked up before cost nothing. Contents
+  // that are about to be truncated are not loaded at all.
+  __wasi_errno_t populate(const char* path, const DentryCache::Entry& entry,
+                          const bool truncate) {
+    if (entry.error != LFS_ERR_OK || !entry.lazy) {
+      return __WASI_ERRNO_SUCCESS;
+    }
+
+    const auto size = entry.size;
+    if (!truncate && size > 0) {
+      lfs_file_t file;
+      RETURN_IF_LFS_ERR(
+          lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_TRUNC));
+      const auto rc = load_lazy_contents(path, file, size);
+      const auto closed = lfs_file_close(&lfs, &file);
+      RETURN_IF_WASI_ERR(rc);
+      RETURN_IF_LFS_ERR(closed);
+    }
+
+    dentries.invalidate(path);
+    RETURN_IF_LFS_ERR(lfs_removeattr(&lfs, path, kLazySizeAttr));
     return __WASI_ERRNO_SUCCESS;
   }
 
-  FileMetadata get_metadata(const char* path) {
-    FileMetadata m = {};
-    if (lfs_getattr(&lfs, path, 1, (void*)&m, sizeof(m)) > 0) {
-      return m;
+  __wasi_errno_t sync_file(FileDescriptor& desc) {
+    dentries.invalidate(desc.path);
+    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+    if (desc.dirty_bytes > 0) {
+      desc.dirty_bytes = 0;
+      std::erase(dirty, &desc);
     }
-    return {};
+    return __WASI_ERRNO_SUCCESS;
   }
 
-  void set_metadata(const char* path, const FileMetadata& m) {
-    lfs_setattr(&lfs, path, 1, (const void*)&m, sizeof(m));
+  // Commits every descriptor with pending writes, makes the filesystem
+  // consistent for path based operations and other descriptors
+  __wasi_errno_t sync_all() {
+    while (!dirty.empty()) {
+      RETURN_IF_WASI_ERR(sync_file(*dirty.back()));
+    }
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Called before accessing a file through desc
+  __wasi_errno_t sync_before(FileDescriptor& desc) {
+    if (sync_mode == SyncMode::kStrict) {
+      RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+      return __WASI_ERRNO_SUCCESS;
+    }
+
+    // pending writes of other descriptors for the same file are only
+    // visible once committed
+    for (auto* other : dirty) {
+      if (other != &desc) {
+        return sync_all();
+      }
+    }
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Moves the littlefs position of desc to `pos`. Seeking flushes a file
+  // that is being written, so it is skipped if the position is unchanged,
+  // e.g. for sequential positional I/O or reads after a pread.
+  __wasi_errno_t position(FileDescriptor& desc, const __wasi_filesize_t pos) {
+    auto& file = desc.file();
+    if (pos > LFS_FILE_MAX) {
+      return __WASI_ERRNO_INVAL;
+    }
+    if (file.pos != pos) {
+      RETURN_IF_LFS_ERR(lfs_file_seek(&lfs, &file, pos, LFS_SEEK_SET));
+    }
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Called after accessing a file through desc with the number of bytes
+  // that were modified
+  __wasi_errno_t sync_after(FileDescriptor& desc, lfs_size_t modified) {
+    if (sync_mode == SyncMode::kStrict) {
+      if (modified > 0) {
+        dentries.invalidate(desc.path);
+      }
+      RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+      return __WASI_ERRNO_SUCCESS;
+    }
+
+    if (modified == 0) {
+      return __WASI_ERRNO_SUCCESS;
+    }
+    if (desc.dirty_bytes == 0) {
+      dirty.push_back(&desc);
+    }
+    desc.dirty_bytes += modified;
+    if (desc.dirty_bytes >= dirty_threshold) {
+      return sync_file(desc);
+    }
+    return __WASI_ERRNO_SUCCESS;
   }
 
   __wasi_errno_t lookup_fd(const __wasi_fd_t fd, const int type,
                            const __wasi_rights_t rights,
                            const bool allow_streams, FileDescriptor** result) {
-    auto iter = fds.find(fd);
-    if (iter == fds.end()) {
+    auto* found = fds.find(fd);
+    if (!found) {
       return __WASI_ERRNO_BADF;
     }
 
-    auto& desc = *iter->second;
+    auto& desc = *found;
     if (desc.stream && !allow_streams) {
       return __WASI_ERRNO_NOTSUP;
     }
@@ -285,10 +492,11 @@ struct Context {
     auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_ALLOCATE);
     const auto required_size = offset + len;
 
+    RETURN_IF_WASI_ERR(sync_before(desc));
     const auto current_size = lfs_file_size(&lfs, &desc.file());
     if (current_size < required_size) {
       RETURN_IF_LFS_ERR(lfs_file_truncate(&lfs, &desc.file(), required_size));
-      RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+      RETURN_IF_WASI_ERR(sync_after(desc, required_size - current_size));
     }
 
     return __WASI_ERRNO_SUCCESS;
@@ -307,6 +515,12 @@ struct Context {
     if (desc.type == LFS_TYPE_DIR) {
       RETURN_IF_LFS_ERR(lfs_dir_close(&lfs, &desc.dir()));
     } else {
+      // closing only changes the file if it has pending writes, the
+      // lookups of files that were just read stay cached
+      if (desc.dirty_bytes > 0) {
+        std::erase(dirty, &desc);
+        dentries.invalidate(desc.path);
+      }
       RETURN_IF_LFS_ERR(lfs_file_close(&lfs, &desc.file()));
     }
     fds.erase(fd);
@@ -314,8 +528,11 @@ struct Context {
   }
 
   __wasi_errno_t fd_datasync(__wasi_fd_t fd) {
-    REQUIRE_FD(fd, __WASI_RIGHTS_FD_DATASYNC);
-    // we currenty flush on all writes so this is a noop
+    auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_DATASYNC);
+    // in strict mode all writes are already committed
+    if (desc.dirty_bytes > 0) {
+      RETURN_IF_WASI_ERR(sync_file(desc));
+    }
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -370,8 +587,11 @@ struct Context {
 
   __wasi_errno_t fd_filestat_set_size(__wasi_fd_t fd, __wasi_filesize_t size) {
     auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_FILESTAT_SET_SIZE);
+    RETURN_IF_WASI_ERR(sync_before(desc));
     RETURN_IF_LFS_ERR(lfs_file_truncate(&lfs, &desc.file(), size));
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+    // any size change counts as a single modified byte
+    RETURN_IF_WASI_ERR(sync_after(desc, 1));
+    RETURN_IF_LFS_ERR(bd.reclaim(&lfs));
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -387,9 +607,10 @@ struct Context {
                           __wasi_size_t* retptr0) {
     auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_READ);
 
-    const auto previous_offset = desc.file().pos;
-    RETURN_IF_LFS_ERR(lfs_file_seek(&lfs, &desc.file(), offset, LFS_SEEK_SET));
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+    // the guest's position is kept in desc, so the littlefs position is left
+    // wherever the read ends
+    RETURN_IF_WASI_ERR(sync_before(desc));
+    RETURN_IF_WASI_ERR(position(desc, offset));
 
     lfs_ssize_t read = 0;
     for (size_t i = 0; i < iovs_len; ++i) {
@@ -397,10 +618,6 @@ struct Context {
           lfs_file_read(&lfs, &desc.file(), iovs[i].buf, iovs[i].buf_len));
     }
 
-    RETURN_IF_LFS_ERR(
-        lfs_file_seek(&lfs, &desc.file(), previous_offset, LFS_SEEK_SET));
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
-
     *retptr0 = read;
     return __WASI_ERRNO_SUCCESS;
   }
@@ -442,19 +659,15 @@ struct Context {
                            size_t iovs_len, __wasi_filesize_t offset,
                            __wasi_size_t* retptr0) {
     auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_WRITE);
-
-    const auto previous_offset = desc.file().pos;
-    RETURN_IF_LFS_ERR(lfs_file_seek(&lfs, &desc.file(), offset, LFS_SEEK_SET));
+    RETURN_IF_WASI_ERR(sync_before(desc));
+    RETURN_IF_WASI_ERR(position(desc, offset));
 
     lfs_ssize_t written = 0;
     for (size_t i = 0; i < iovs_len; ++i) {
       written += RETURN_IF_LFS_ERR(
           lfs_file_write(&lfs, &desc.file(), iovs[i].buf, iovs[i].buf_len));
     }
-
-    RETURN_IF_LFS_ERR(
-        lfs_file_seek(&lfs, &desc.file(), previous_offset, LFS_SEEK_SET));
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+    RETURN_IF_WASI_ERR(sync_after(desc, written));
 
     *retptr0 = written;
     return __WASI_ERRNO_SUCCESS;
@@ -464,34 +677,124 @@ struct Context {
                          size_t iovs_len, __wasi_size_t* retptr0) {
     auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_READ);
 
+    if (sync_mode == SyncMode::kWriteBack) {
+      RETURN_IF_WASI_ERR(sync_before(desc));
+    }
+    RETURN_IF_WASI_ERR(position(desc, desc.pos));
+
     lfs_ssize_t read = 0;
     for (size_t i = 0; i < iovs_len; ++i) {
       read += RETURN_IF_LFS_ERR(
           lfs_file_read(&lfs, &desc.file(), iovs[i].buf, iovs[i].buf_len));
     }
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &desc.file()));
+    desc.pos = desc.file().pos;
+    RETURN_IF_WASI_ERR(sync_after(desc, 0));
 
     *retptr0 = read;
     return __WASI_ERRNO_SUCCESS;
   }
 
-  __wasi_errno_t fd_readdir(__wasi_fd_t fd, MutableView<uint8_t>& buffer,
-                            __wasi_dircookie_t cookie, __wasi_size_t* retptr0) {
-    return __WASI_ERRNO_NOSYS;
+  __wasi_errno_t fd_readdir(CallFrame& frame, __wasi_fd_t fd, int32_t buf,
+                            __wasi_size_t buf_len, __wasi_dircookie_t cookie,
+                            __wasi_size_t* retptr0) {
+    auto& desc =
+        REQUIRE_TYPED_FD(fd, LFS_TYPE_DIR, __WASI_RIGHTS_FD_READDIR, false);
+    auto& dir = desc.dir();
+    if (!desc.dir_open) {
+      RETURN_IF_LFS_ERR(lfs_dir_open(&lfs, &dir, desc.path.c_str()));
+      desc.dir_open = true;
+    }
+
+    if (cookie != desc.dir_cookie) {
+      desc.dir_pending.reset();
+      desc.dir_cookie = 0;
+      const auto rc = lfs_dir_seek(&lfs, &dir, cookie);
+      if (rc == LFS_ERR_INVAL) {
+        // past the end of the directory
+        RETURN_IF_LFS_ERR(lfs_dir_rewind(&lfs, &dir));
+        *retptr0 = 0;
+        return __WASI_ERRNO_SUCCESS;
+      }
+      RETURN_IF_LFS_ERR(rc);
+      desc.dir_cookie = cookie;
+    }
+
+    // entries are staged in the call frame and copied out whenever it fills
+    // up, so the size of the guest buffer doesn't matter
+    const auto staging = frame.alloc_uninitialized<uint8_t>(4096);
+    __wasi_size_t used = 0;
+    std::size_t staged = 0;
+    const auto emit = [&](const void* data, const __wasi_size_t size) {
+      const auto* bytes = static_cast<const uint8_t*>(data);
+      for (auto remaining = std::min(size, buf_len - used); remaining > 0;) {
+        const auto n =
+            std::min<std::size_t>(remaining, staging.size() - staged);
+        memcpy(staging.data() + staged, bytes, n);
+        staged += n;
+        bytes += n;
+        used += n;
+        remaining -= n;
+        if (staged == staging.size()) {
+          copy_out(reinterpret_cast<int32_t>(staging.data()),
+                   buf + used - staged, staged);
+          staged = 0;
+        }
+      }
+    };
+
+    while (used < buf_len) {
+      lfs_info info;
+      if (desc.dir_pending) {
+        info = *desc.dir_pending;
+        desc.dir_pending.reset();
+      } else if (RETURN_IF_LFS_ERR(lfs_dir_read(&lfs, &dir, &info)) == 0) {
+        break;
+      }
+      if (is_hidden_entry(desc.path, info.name)) {
+        ++desc.dir_cookie;
+        continue;
+      }
+
+      const auto name_len = static_cast<__wasi_size_t>(strlen(info.name));
+      // zeroed as a whole so the padding doesn't leak memfs memory
+      __wasi_dirent_t dirent;
+      memset(&dirent, 0, sizeof(dirent));
+      dirent.d_next = desc.dir_cookie + 1;
+      // entries are only created on stat and open, a large listing would
+      // otherwise fill the table
+      dirent.d_ino = inodes.ino(child_path(desc.path, info.name));
+      dirent.d_namlen = name_len;
+      dirent.d_type = from_lfs_type(info.type);
+      if (buf_len - used < sizeof(dirent) + name_len) {
+        // the guest sees a truncated entry and asks for it again starting
+        // from its cookie
+        desc.dir_pending = info;
+      } else {
+        ++desc.dir_cookie;
+      }
+      emit(&dirent, sizeof(dirent));
+      emit(info.name, name_len);
+    }
+
+    if (staged > 0) {
+      copy_out(reinterpret_cast<int32_t>(staging.data()), buf + used - staged,
+               staged);
+    }
+    *retptr0 = used;
+    return __WASI_ERRNO_SUCCESS;
   }
 
   __wasi_errno_t fd_renumber(__wasi_fd_t fd, __wasi_fd_t to) {
     RETURN_IF_WASI_ERR(require_not_preopen(fd));
-    const auto iter = fds.find(fd);
-    if (iter == fds.end()) {
+    if (!fds.find(fd) || !fds.find(to)) {
       return __WASI_ERRNO_BADF;
     }
-    if (fds.find(to) != fds.end()) {
-      RETURN_IF_WASI_ERR(fd_close(to));
+    if (fd == to) {
+      return __WASI_ERRNO_SUCCESS;
     }
+    RETURN_IF_WASI_ERR(fd_close(to));
 
-    REQUIRE(fds.emplace(to, std::move(iter->second)).second);
-    fds.erase(fd);
+    fds.renumber(fd, to);
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -506,7 +809,13 @@ struct Context {
       return __WASI_ERRNO_SPIPE;
     }
 
+    if (is_read_only) {
+      *retptr0 = desc.pos;
+      return __WASI_ERRNO_SUCCESS;
+    }
+
     auto& file = desc.file();
+    RETURN_IF_WASI_ERR(position(desc, desc.pos));
     switch (whence) {
       case __WASI_WHENCE_SET:
         *retptr0 =
@@ -523,13 +832,17 @@ struct Context {
       default:
         return __WASI_ERRNO_INVAL;
     }
+    desc.pos = *retptr0;
 
     return __WASI_ERRNO_SUCCESS;
   }
 
   __wasi_errno_t fd_sync(__wasi_fd_t fd) {
-    REQUIRE_FD(fd, __WASI_RIGHTS_FD_SYNC);
-    // we currenty flush on all writes so this is a noop
+    auto& desc = REQUIRE_FD(fd, __WASI_RIGHTS_FD_SYNC);
+    // in strict mode all writes are already committed
+    if (desc.dirty_bytes > 0) {
+      RETURN_IF_WASI_ERR(sync_file(desc));
+    }
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -544,9 +857,9 @@ struct Context {
     lfs_ssize_t written = 0;
 
     auto& file = desc.file();
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &file));
+    RETURN_IF_WASI_ERR(sync_before(desc));
+    RETURN_IF_WASI_ERR(position(desc, desc.pos));
 
-    const auto previous_offset = file.pos;
     const bool append = desc.fd_flags & __WASI_FDFLAGS_APPEND;
     if (append) {
       file.flags |= LFS_O_APPEND;
@@ -558,13 +871,13 @@ struct Context {
     }
 
     if (append) {
-      // reset file position
+      // the position is left unchanged
       file.flags &= ~LFS_O_APPEND;
-      RETURN_IF_LFS_ERR(
-          lfs_file_seek(&lfs, &file, previous_offset, LFS_SEEK_SET));
+    } else {
+      desc.pos = file.pos;
     }
 
-    RETURN_IF_LFS_ERR(lfs_file_sync(&lfs, &file));
+    RETURN_IF_WASI_ERR(sync_after(desc, written));
 
     *retptr0 = written;
     return __WASI_ERRNO_SUCCESS;
@@ -577,7 +890,9 @@ struct Context {
     RETURN_IF_WASI_ERR(resolve_path(frame, fd, unresolved_path,
                                     __WASI_RIGHTS_PATH_CREATE_DIRECTORY,
                                     &path));
+    dentries.invalidate(path);
     RETURN_IF_LFS_ERR(lfs_mkdir(&lfs, path));
+    adjust_nlink(parent_path(path), 1);
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -633,30 +948,37 @@ struct Context {
     const char* path;
     RETURN_IF_WASI_ERR(resolve_path(frame, dir.path, unresolved_path, &path));
 
-    auto desc = std::make_unique<FileDescriptor>();
+    auto desc = fds.acquire();
     desc->path = path;
     desc->rights_inheriting = fs_rights_inheriting;
     desc->fd_flags = fd_flags;
     desc->rights_base = fs_rights_base & dir.rights_inheriting;
     if (oflags & __WASI_OFLAGS_DIRECTORY) {
       desc->type = LFS_TYPE_DIR;
-      desc->rights_base &= ~WASI_FD_RIGHTS;
+      // directories can only be listed, none of the other fd rights apply
+      desc->rights_base &= ~WASI_FD_RIGHTS | __WASI_RIGHTS_FD_READDIR;
       RETURN_IF_LFS_ERR(lfs_dir_open(&lfs, &desc->dir(), path));
+      desc->dir_open = true;
     } else {
       desc->type = LFS_TYPE_REG;
       desc->rights_base &= ~WASI_PATH_RIGHTS;
+      DentryCache::Entry entry;
+      const auto rc = lookup(path, &entry);
+      // fail before loading contents that the open would not use
+      if (rc == LFS_ERR_OK && (oflags & __WASI_OFLAGS_CREAT) &&
+          (oflags & __WASI_OFLAGS_EXCL)) {
+        return __WASI_ERRNO_EXIST;
+      }
+      RETURN_IF_WASI_ERR(populate(path, entry, oflags & __WASI_OFLAGS_TRUNC));
+      if (oflags & (__WASI_OFLAGS_CREAT | __WASI_OFLAGS_TRUNC)) {
+        dentries.invalidate(path);
+      }
       RETURN_IF_LFS_ERR(
           lfs_file_open(&lfs, &desc->file(), path,
                         to_lfs_open_flags(oflags, desc->rights_base)));
     }
 
-    const auto new_fd = allocate_fd();
-    REQUIRE(fds.emplace(new_fd, std::move(desc)).second);
-
-    auto m = get_metadata(path);
-    set_metadata(path, m);
-
-    *retptr0 = new_fd;
+    *retptr0 = fds.install(std::move(desc));
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -675,13 +997,17 @@ struct Context {
                                     __WASI_RIGHTS_PATH_REMOVE_DIRECTORY,
                                     &path));
 
-    lfs_info info{};
-    const auto rc = lfs_stat(&lfs, path, &info);
-    if (rc == LFS_ERR_OK && info.type != LFS_TYPE_DIR) {
+    DentryCache::Entry entry;
+    const auto rc = lookup(path, &entry);
+    if (rc == LFS_ERR_OK && entry.type != LFS_TYPE_DIR) {
       return __WASI_ERRNO_NOTDIR;
     }
 
+    dentries.invalidate(path);
     RETURN_IF_LFS_ERR(lfs_remove(&lfs, path));
+    inodes.remove(path);
+    adjust_nlink(parent_path(path), -1);
+    RETURN_IF_LFS_ERR(bd.reclaim(&lfs));
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -714,6 +1040,12 @@ struct Context {
       }
     }
 
+    DentryCache::Entry replaced;
+    const auto replaces_dir = lookup(new_path, &replaced) == LFS_ERR_OK &&
+                              replaced.type == LFS_TYPE_DIR;
+
+    // renaming a directory moves everything below it
+    dentries.clear();
     const auto result = lfs_rename(&lfs, old_path, new_path);
     if (result == LFS_ERR_ISDIR) {
       // for type mismatches use error code based on destination file type
@@ -722,6 +1054,14 @@ struct Context {
     }
     RETURN_IF_LFS_ERR(result);
 
+    inodes.rename(old_path, new_path);
+    if (!is_old_file) {
+      adjust_nlink(parent_path(old_path), -1);
+      if (!replaces_dir) {
+        adjust_nlink(parent_path(new_path), 1);
+      }
+    }
+
     return __WASI_ERRNO_SUCCESS;
   }
 
@@ -737,9 +1077,9 @@ struct Context {
     RETURN_IF_WASI_ERR(resolve_path(frame, fd, unresolved_path,
                                     __WASI_RIGHTS_PATH_UNLINK_FILE, &path));
 
-    lfs_info info{};
-    const auto rc = lfs_stat(&lfs, path, &info);
-    if (rc == LFS_ERR_OK && info.type == LFS_TYPE_DIR) {
+    DentryCache::Entry entry;
+    const auto rc = lookup(path, &entry);
+    if (rc == LFS_ERR_OK && entry.type == LFS_TYPE_DIR) {
       return __WASI_ERRNO_ISDIR;
     }
 
@@ -748,15 +1088,252 @@ struct Context {
       return __WASI_ERRNO_NOTDIR;
     }
 
+    dentries.invalidate(path);
     RETURN_IF_LFS_ERR(lfs_remove(&lfs, path));
+    inodes.remove(path);
+    RETURN_IF_LFS_ERR(bd.reclaim(&lfs));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Replaces the filesystem with a prebuilt image, must be called before any
+  // files are opened. Takes ownership of the malloc'd image.
+  __wasi_errno_t image_load(uint8_t* image, std::size_t size) {
+    REQUIRE(fds.empty());
+    dentries.clear();
+    inodes.clear();
+    RETURN_IF_LFS_ERR(lfs_unmount(&lfs));
+    const auto rc = bd.load_image(image, size);
+    RETURN_IF_LFS_ERR(lfs_mount(&lfs, &cfg));
+    RETURN_IF_LFS_ERR(rc);
     return __WASI_ERRNO_SUCCESS;
   }
 
+  // Drops the manifest entry of a lazily loaded file whose contents are
+  // replaced by the host, populate would otherwise load over them
+  __wasi_errno_t forget_lazy_file(const char* path) {
+    lfs_size_t size = 0;
+    if (lfs_getattr(&lfs, path, kLazySizeAttr, &size, sizeof(size)) !=
+        sizeof(size)) {
+      return __WASI_ERRNO_SUCCESS;
+    }
+    RETURN_IF_LFS_ERR(lfs_removeattr(&lfs, path, kLazySizeAttr));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Registers a file whose contents are loaded on first open, see populate
+  __wasi_errno_t add_lazy_file(const char* path, const lfs_size_t size) {
+    dentries.invalidate(path);
+    lfs_file_t file;
+    RETURN_IF_LFS_ERR(lfs_file_open(&lfs, &file, path,
+                                    LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC));
+    RETURN_IF_LFS_ERR(lfs_file_close(&lfs, &file));
+    RETURN_IF_LFS_ERR(
+        lfs_setattr(&lfs, path, kLazySizeAttr, &size, sizeof(size)));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Opens `path` for writing by the host, its contents are then written with
+  // ingest_write and committed with ingest_end
+  __wasi_errno_t ingest_begin(const char* path, int32_t* handle) {
+    auto ingest = std::make_unique<Ingest>();
+    ingest->path = path;
+    dentries.invalidate(path);
+    RETURN_IF_WASI_ERR(forget_lazy_file(path));
+    RETURN_IF_LFS_ERR(lfs_file_open(&lfs, &ingest->file, path,
+                                    LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC));
+    *handle = next_ingest++;
+    ingests.emplace(*handle, std::move(ingest));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  __wasi_errno_t ingest_write(const int32_t handle, const void* data,
+                              const lfs_size_t size) {
+    const auto iter = ingests.find(handle);
+    if (iter == ingests.end()) {
+      return __WASI_ERRNO_BADF;
+    }
+    RETURN_IF_LFS_ERR(lfs_file_write(&lfs, &iter->second->file, data, size));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  __wasi_errno_t ingest_end(const int32_t handle) {
+    const auto iter = ingests.find(handle);
+    if (iter == ingests.end()) {
+      return __WASI_ERRNO_BADF;
+    }
+    const auto ingest = std::move(iter->second);
+    ingests.erase(iter);
+    dentries.invalidate(ingest->path);
+    RETURN_IF_LFS_ERR(lfs_file_close(&lfs, &ingest->file));
+    if (ingest->spool) {
+      RETURN_IF_LFS_ERR(lfs_remove(&lfs, ingest->path.c_str()));
+      // fails while other spools exist
+      lfs_remove(&lfs, kSpoolDir.data());
+      RETURN_IF_LFS_ERR(bd.reclaim(&lfs));
+    }
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Creates an anonymous file the host appends to with ingest_write and
+  // reads back with spool_read, which keeps data like a large stdin in the
+  // block device rather than in the JavaScript heap. ingest_end removes it.
+  __wasi_errno_t spool_begin(int32_t* handle) {
+    const auto rc = lfs_mkdir(&lfs, kSpoolDir.data());
+    if (rc != LFS_ERR_EXIST) {
+      RETURN_IF_LFS_ERR(rc);
+    }
+
+    auto ingest = std::make_unique<Ingest>();
+    ingest->path = std::string{kSpoolDir} + "/" + std::to_string(next_ingest);
+    ingest->spool = true;
+    RETURN_IF_LFS_ERR(lfs_file_open(
+        &lfs, &ingest->file, ingest->path.c_str(),
+        LFS_O_RDWR | LFS_O_CREAT | LFS_O_TRUNC | LFS_O_APPEND));
+    *handle = next_ingest++;
+    ingests.emplace(*handle, std::move(ingest));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  __wasi_errno_t spool_read(const int32_t handle, const lfs_off_t offset,
+                            void* data, const lfs_size_t size,
+                            __wasi_size_t* read) {
+    const auto iter = ingests.find(handle);
+    if (iter == ingests.end() || !iter->second->spool) {
+      return __WASI_ERRNO_BADF;
+    }
+    auto& file = iter->second->file;
+    if (file.pos != offset) {
+      RETURN_IF_LFS_ERR(lfs_file_seek(&lfs, &file, offset, LFS_SEEK_SET));
+    }
+    *read = RETURN_IF_LFS_ERR(lfs_file_read(&lfs, &file, data, size));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Returns the filesystem to the state at the end of initialization, see
+  // BlockDevice::checkpoint. Every descriptor is dropped, the caller installs
+  // stdio and the preopens again.
+  __wasi_errno_t reset() {
+    if (!bd.has_checkpoint()) {
+      return __WASI_ERRNO_NOTSUP;
+    }
+
+    // closing may still write to the device, which restore() undoes anyway,
+    // so errors are irrelevant here
+    fds.for_each([&](__wasi_fd_t, FileDescriptor& desc) {
+      if (desc.stream) {
+        return;
+      }
+      if (desc.type == LFS_TYPE_DIR) {
+        if (desc.dir_open) {
+          lfs_dir_close(&lfs, &desc.dir());
+        }
+      } else {
+        lfs_file_close(&lfs, &desc.file());
+      }
+    });
+    for (auto& [handle, ingest] : ingests) {
+      lfs_file_close(&lfs, &ingest->file);
+    }
+    fds.clear();
+    dirty.clear();
+    ingests.clear();
+
+    dentries.clear();
+    inodes = inodes_at_checkpoint;
+    RETURN_IF_LFS_ERR(lfs_unmount(&lfs));
+    bd.restore();
+    RETURN_IF_LFS_ERR(lfs_mount(&lfs, &cfg));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Mounts the shared base image as a copy-on-write overlay, see
+  // BlockDevice::attach_base. Must be called before any files are opened.
+  __wasi_errno_t image_attach_base() {
+    REQUIRE(fds.empty());
+    dentries.clear();
+    inodes.clear();
+    RETURN_IF_LFS_ERR(lfs_unmount(&lfs));
+    bd.attach_base();
+    RETURN_IF_LFS_ERR(lfs_mount(&lfs, &cfg));
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  __wasi_errno_t stats(Stats* result) {
+    const auto in_use = RETURN_IF_LFS_ERR(lfs_fs_size(&lfs));
+    const auto& counters = bd.stats();
+    *result = {
+        .bd_reads = counters.reads,
+        .bd_read_bytes = counters.read_bytes,
+        .bd_base_reads = counters.base_reads,
+        .bd_progs = counters.progs,
+        .bd_prog_bytes = counters.prog_bytes,
+        .bd_erases = counters.erases,
+        .block_count = bd.capacity(),
+        .blocks_in_use = static_cast<uint64_t>(in_use),
+        .blocks_allocated = bd.blocks_allocated(),
+        .blocks_retained = bd.blocks_retained(),
+    };
+#ifdef __wasm__
+    result->memory_bytes = __builtin_wasm_memory_size(0) * 65536;
+    result->dynamic_bytes =
+        result->memory_bytes - reinterpret_cast<uintptr_t>(&__heap_base);
+#endif
+    return __WASI_ERRNO_SUCCESS;
+  }
+
+  // Serializes the filesystem into a malloc'd image, returns nullptr on
+  // failure
+  uint8_t* image_save(std::size_t* size) {
+    if (sync_all() != __WASI_ERRNO_SUCCESS) {
+      return nullptr;
+    }
+    for (auto& [path, node] : inodes) {
+      if (!node.dirty) {
+        continue;
+      }
+      if (lfs_setattr(&lfs, path.c_str(), kMetadataAttr, &node.metadata,
+                      sizeof(node.metadata)) < 0) {
+        return nullptr;
+      }
+      node.dirty = false;
+    }
+    if (bd.trim(&lfs) < 0) {
+      return nullptr;
+    }
+    return bd.save_image(size);
+  }
+
  private:
+  __wasi_errno_t load_lazy_contents(const char* path, lfs_file_t& file,
+                                    const lfs_size_t size) {
+    // bounded scratch space regardless of the file size
+    constexpr lfs_size_t kChunkSize = 32 * 1024;
+    const auto chunk = std::make_unique<uint8_t[]>(std::min(size, kChunkSize));
+    const auto path_len = static_cast<int32_t>(strlen(path));
+
+    for (lfs_size_t off = 0; off < size;) {
+      const auto want = std::min(size - off, kChunkSize);
+      const auto got =
+          lazy_load(reinterpret_cast<int32_t>(path), path_len, off,
+                    reinterpret_cast<int32_t>(chunk.get()), want);
+      if (got <= 0 || static_cast<lfs_size_t>(got) > want) {
+        return __WASI_ERRNO_IO;
+      }
+      RETURN_IF_LFS_ERR(lfs_file_write(&lfs, &file, chunk.get(), got));
+      off += got;
+    }
+    return __WASI_ERRNO_SUCCESS;
+  }
+
   __wasi_errno_t set_file_times(const char* path, const __wasi_timestamp_t atim,
                                 const __wasi_timestamp_t mtim,
                                 const __wasi_fstflags_t fst_flags) {
-    auto m = get_metadata(path);
+    RETURN_IF_WASI_ERR(sync_all());
+
+    DentryCache::Entry entry;
+    RETURN_IF_LFS_ERR(lookup(path, &entry));
+    auto& node = inode(path, entry.type);
+    auto m = node.metadata;
     if ((fst_flags & __WASI_FSTFLAGS_ATIM) &&
         (fst_flags & __WASI_FSTFLAGS_ATIM_NOW)) {
       return __WASI_ERRNO_INVAL;
@@ -781,14 +1358,14 @@ struct Context {
       m.mtim = now_ms() * 10000000;
     }
 
-    set_metadata(path, m);
+    node.metadata = m;
+    node.dirty = true;
     return __WASI_ERRNO_SUCCESS;
   }
 
   bool is_regular_file(const char* path) {
-    lfs_info info{};
-    return lfs_stat(&lfs, path, &info) == LFS_ERR_OK &&
-           info.type == LFS_TYPE_REG;
+    DentryCache::Entry entry;
+    return lookup(path, &entry) == LFS_ERR_OK && entry.type == LFS_TYPE_REG;
   }
 
   __wasi_errno_t verify_is_valid_file_path(const char* path) {
@@ -802,22 +1379,15 @@ struct Context {
   __wasi_errno_t resolve_path(CallFrame& frame, const std::string_view& dir,
                               const std::string_view& unresolved_path,
                               const char** result) {
-    // TODO: proper canonicalize
-    const auto new_path_size = dir.size() + unresolved_path.size() + 2;
-    auto resolved_path = frame.alloc_uninitialized<char>(new_path_size);
-
-    char* iter = resolved_path.data();
-    memcpy(iter, dir.begin(), dir.size());
-    iter += dir.size();
-
-    if (unresolved_path == ".") {
-      *iter = 0;
-    } else {
-      *iter = '/';
-      ++iter;
-      memcpy(iter, &unresolved_path[0], unresolved_path.size());
-      iter += unresolved_path.size();
-      *iter = 0;
+    // path operations observe the filesystem, not individual descriptors
+    RETURN_IF_WASI_ERR(sync_all());
+
+    auto resolved_path = frame.alloc_uninitialized<char>(
+        canonical_path_size(dir, unresolved_path));
+    RETURN_IF_WASI_ERR(
+        canonicalize_path(dir, unresolved_path, resolved_path));
+    if (is_spool_path(resolved_path.data())) {
+      return __WASI_ERRNO_NOENT;
     }
 
     *result = resolved_path.data();
@@ -834,30 +1404,163 @@ struct Context {
   }
 } state;
 
+// Transfers are staged in memfs memory and handled in windows of at most
+// this many bytes, so a single call can move any amount of data with bounded
+// memory
+constexpr __wasi_size_t kIoWindowSize = 256 * 1024;
+
+template <class Iovec>
+std::size_t io_window_size(const std::span<Iovec> iovs) {
+  uint64_t total = 0;
+  for (const auto& iov : iovs) {
+    total += iov.buf_len;
+  }
+  return std::min<uint64_t>(total, kIoWindowSize);
+}
+
+// Fills `staged` with iovecs covering the next window of `iovs`, starting
+// `*skip` bytes into iovs[*index], that point into `window`. `host`
+// receives the host address each of them corresponds to. Returns the number
+// of staged iovecs.
+template <class Iovec>
+std::size_t next_io_window(const std::span<Iovec> iovs, std::size_t* index,
+                           __wasi_size_t* skip, const std::span<uint8_t> window,
+                           const std::span<Iovec> staged,
+                           const std::span<int32_t> host) {
+  std::size_t count = 0;
+  std::size_t used = 0;
+  while (*index < iovs.size()) {
+    const auto& iov = iovs[*index];
+    // empty iovecs are passed over even once the window is full, otherwise a
+    // zero-length transfer would never reach the end of the array
+    if (iov.buf_len == *skip) {
+      ++*index;
+      *skip = 0;
+      continue;
+    }
+    if (used == window.size()) {
+      break;
+    }
+    const auto size = static_cast<__wasi_size_t>(
+        std::min<std::size_t>(iov.buf_len - *skip, window.size() - used));
+    host[count] = reinterpret_cast<int32_t>(iov.buf) + *skip;
+    staged[count].buf = window.data() + used;
+    staged[count].buf_len = size;
+    ++count;
+    used += size;
+    *skip += size;
+    if (*skip == iov.buf_len) {
+      ++*index;
+      *skip = 0;
+    }
+  }
+  return count;
+}
+
+// Copies the iovec array into memfs memory and then the buffers it refers to,
+// one window at a time with a single batched copy each. The callback gets
+// the staged iovecs and the number of bytes already transferred, and is
+// called until the buffers are exhausted or it transfers less than a window.
 template <class T>
 auto with_external_ciovs(CallFrame& frame, int32_t iovs_ptr, int32_t iovs_len,
-                         T&& callback) {
-  auto iovs = frame.ref_array<__wasi_ciovec_t>(iovs_ptr, iovs_len);
-  for (auto& iov : iovs) {
-    iov.buf = frame.ref_array<uint8_t>(iov.buf, iov.buf_len).data();
+                         int32_t retptr, T&& callback) {
+  const auto iovs = frame.ref_array<__wasi_ciovec_t>(iovs_ptr, iovs_len);
+  const auto window = frame.alloc_uninitialized<uint8_t>(io_window_size(iovs));
+  const auto staged = frame.alloc_uninitialized<__wasi_ciovec_t>(iovs_len);
+  const auto host = frame.alloc_uninitialized<int32_t>(iovs_len);
+  CopyBatch batch(frame, iovs_len);
+
+  __wasi_size_t* result = &frame.alloc_uninitialized<__wasi_size_t>(1)[0];
+  *result = 0;
+  __wasi_errno_t rc;
+  std::size_t index = 0;
+  __wasi_size_t skip = 0;
+  do {
+    const auto count =
+        next_io_window(iovs, &index, &skip, window, staged, host);
+    __wasi_size_t size = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      batch.add(host[i], reinterpret_cast<int32_t>(staged[i].buf),
+                staged[i].buf_len);
+      size += staged[i].buf_len;
+    }
+    batch.copy_in();
+
+    __wasi_size_t transferred = 0;
+    rc = callback(staged.data(), count, *result, &transferred);
+    if (rc != __WASI_ERRNO_SUCCESS) {
+      break;
+    }
+    *result += transferred;
+    if (transferred < size) {
+      break;
+    }
+  } while (index < iovs.size());
+
+  // a failure after some windows were transferred is a short write
+  if (*result > 0) {
+    rc = __WASI_ERRNO_SUCCESS;
+  }
+  if (rc == __WASI_ERRNO_SUCCESS) {
+    copy_out(reinterpret_cast<int32_t>(result), retptr, sizeof(*result));
   }
-  return callback(iovs.data());
+  return rc;
 }
 
+// Provides uninitialized buffers for the iovec array, one window at a time,
+// and copies the bytes that were filled in back to the host. The copy of the
+// last window is batched with the number of bytes transferred.
 template <class T>
 auto with_external_iovs(CallFrame& frame, int32_t iovs_ptr, int32_t iovs_len,
-                        T&& callback) {
-  auto iovs = frame.ref_array<__wasi_iovec_t>(iovs_ptr, iovs_len);
+                        int32_t retptr, T&& callback) {
+  const auto iovs = frame.ref_array<__wasi_iovec_t>(iovs_ptr, iovs_len);
+  const auto window = frame.alloc_uninitialized<uint8_t>(io_window_size(iovs));
+  const auto staged = frame.alloc_uninitialized<__wasi_iovec_t>(iovs_len);
+  const auto host = frame.alloc_uninitialized<int32_t>(iovs_len);
+  CopyBatch batch(frame, iovs_len + 1);
+
+  __wasi_size_t* result = &frame.alloc_uninitialized<__wasi_size_t>(1)[0];
+  *result = 0;
+  __wasi_errno_t rc;
+  std::size_t index = 0;
+  __wasi_size_t skip = 0;
+  do {
+    // the previous window is reused
+    batch.copy_out();
+    const auto count =
+        next_io_window(iovs, &index, &skip, window, staged, host);
+    __wasi_size_t size = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      size += staged[i].buf_len;
+    }
 
-  std::vector<MutableView<uint8_t>> rw_buffers;
-  rw_buffers.reserve(iovs_len);
+    __wasi_size_t transferred = 0;
+    rc = callback(staged.data(), count, *result, &transferred);
+    if (rc != __WASI_ERRNO_SUCCESS) {
+      break;
+    }
+
+    auto remaining = transferred;
+    for (std::size_t i = 0; i < count && remaining > 0; ++i) {
+      const auto n = std::min(remaining, staged[i].buf_len);
+      batch.add(reinterpret_cast<int32_t>(staged[i].buf), host[i], n);
+      remaining -= n;
+    }
+    *result += transferred;
+    if (transferred < size) {
+      break;
+    }
+  } while (index < iovs.size());
 
-  for (auto& iov : iovs) {
-    rw_buffers.emplace_back(frame, reinterpret_cast<int32_t>(iov.buf),
-                            iov.buf_len);
-    iov.buf = rw_buffers.back().value.data();
+  // a failure after some windows were transferred is a short read
+  if (*result > 0) {
+    rc = __WASI_ERRNO_SUCCESS;
   }
-  return callback(iovs.data());
+  if (rc == __WASI_ERRNO_SUCCESS) {
+    batch.add(reinterpret_cast<int32_t>(result), retptr, sizeof(*result));
+  }
+  batch.copy_out();
+  return rc;
 }
 
 #define EXPORT(x) __attribute__((__export_name__(#x))) x
@@ -907,10 +1610,12 @@ int32_t EXPORT(fd_filestat_set_times)(int32_t arg0, int64_t arg1, int64_t arg2,
 int32_t EXPORT(fd_pread)(int32_t arg0, int32_t arg1, int32_t arg2, int64_t arg3,
                          int32_t arg4) {
   CallFrame frame;
-  MutableView<__wasi_size_t> out(frame, arg4);
-  return with_external_iovs(frame, arg1, arg2, [&](__wasi_iovec_t* iovs) {
-    return state.fd_pread(arg0, iovs, arg2, arg3, &out.get());
-  });
+  return with_external_iovs(
+      frame, arg1, arg2, arg4,
+      [&](const __wasi_iovec_t* iovs, const std::size_t iovs_len,
+          const __wasi_size_t done, __wasi_size_t* out) {
+        return state.fd_pread(arg0, iovs, iovs_len, arg3 + done, out);
+      });
 }
 
 int32_t EXPORT(fd_prestat_get)(int32_t arg0, int32_t arg1) {
@@ -928,28 +1633,30 @@ int32_t EXPORT(fd_prestat_dir_name)(int32_t arg0, int32_t arg1, int32_t arg2) {
 int32_t EXPORT(fd_pwrite)(int32_t arg0, int32_t arg1, int32_t arg2,
                           int64_t arg3, int32_t arg4) {
   CallFrame frame;
-  MutableView<__wasi_size_t> out(frame, arg4);
-
-  return with_external_ciovs(frame, arg1, arg2, [&](__wasi_ciovec_t* iovs) {
-    return state.fd_pwrite(arg0, iovs, arg2, arg3, &out.get());
-  });
+  return with_external_ciovs(
+      frame, arg1, arg2, arg4,
+      [&](const __wasi_ciovec_t* iovs, const std::size_t iovs_len,
+          const __wasi_size_t done, __wasi_size_t* out) {
+        return state.fd_pwrite(arg0, iovs, iovs_len, arg3 + done, out);
+      });
 }
 
 int32_t EXPORT(fd_read)(int32_t arg0, int32_t arg1, int32_t arg2,
                         int32_t arg3) {
   CallFrame frame;
-  MutableView<__wasi_size_t> out(frame, arg3);
-  return with_external_iovs(frame, arg1, arg2, [&](__wasi_iovec_t* iovs) {
-    return state.fd_read(arg0, iovs, arg2, &out.get());
-  });
+  return with_external_iovs(
+      frame, arg1, arg2, arg3,
+      [&](const __wasi_iovec_t* iovs, const std::size_t iovs_len,
+          __wasi_size_t, __wasi_size_t* out) {
+        return state.fd_read(arg0, iovs, iovs_len, out);
+      });
 }
 
 int32_t EXPORT(fd_readdir)(int32_t arg0, int32_t arg1, int32_t arg2,
                            int64_t arg3, int32_t arg4) {
   CallFrame frame;
-  MutableView<uint8_t> out1(frame, arg1, arg2);
-  MutableView<__wasi_size_t> out2(frame, arg4);
-  return state.fd_readdir(arg0, out1, arg3, &out2.get());
+  MutableView<__wasi_size_t> out(frame, arg4);
+  return state.fd_readdir(frame, arg0, arg1, arg2, arg3, &out.get());
 }
 
 int32_t EXPORT(fd_renumber)(int32_t arg0, int32_t arg1) {
@@ -974,10 +1681,12 @@ int32_t EXPORT(fd_tell)(int32_t arg0, int32_t arg1) {
 int32_t EXPORT(fd_write)(int32_t arg0, int32_t arg1, int32_t arg2,
                          int32_t arg3) {
   CallFrame frame;
-  MutableView<__wasi_size_t> out(frame, arg3);
-  return with_external_ciovs(frame, arg1, arg2, [&](__wasi_ciovec_t* iovs) {
-    return state.fd_write(arg0, iovs, arg2, &out.get());
-  });
+  return with_external_ciovs(
+      frame, arg1, arg2, arg3,
+      [&](const __wasi_ciovec_t* iovs, const std::size_t iovs_len,
+          __wasi_size_t, __wasi_size_t* out) {
+        return state.fd_write(arg0, iovs, iovs_len, out);
+      });
 }
 
 int32_t EXPORT(path_create_directory)(int32_t arg0, int32_t arg1,
@@ -1055,17 +1764,17 @@ int32_t EXPORT(path_unlink_file)(int32_t arg0, int32_t arg1, int32_t arg2) {
 }
 
 namespace {
-std::unique_ptr<FileDescriptor> make_preopen_fd(const std::string_view& path) {
-  auto desc = std::make_unique<FileDescriptor>();
+FdTable::Handle make_preopen_fd(const std::string_view& path) {
+  auto desc = state.fds.acquire();
   desc->path = path;
   desc->type = LFS_TYPE_DIR;
-  desc->rights_base = WASI_PATH_RIGHTS;
+  desc->rights_base = WASI_PATH_RIGHTS | __WASI_RIGHTS_FD_READDIR;
   desc->rights_inheriting = ~(__wasi_rights_t{});
   return desc;
 }
 
-std::unique_ptr<FileDescriptor> make_stream_fd(const __wasi_rights_t rights) {
-  auto desc = std::make_unique<FileDescriptor>();
+FdTable::Handle make_stream_fd(const __wasi_rights_t rights) {
+  auto desc = state.fds.acquire();
   desc->type = LFS_TYPE_REG;
   desc->rights_base = __WASI_RIGHTS_POLL_FD_READWRITE | rights;
   desc->rights_inheriting = ~(__wasi_rights_t{});
@@ -1076,6 +1785,7 @@ std::unique_ptr<FileDescriptor> make_stream_fd(const __wasi_rights_t rights) {
 void mkdirp(const char* path) {
   auto* copy = strdup(path);
   const char* parent = dirname(copy);
+  state.dentries.invalidate(parent);
   if (!strcmp(parent, path)) {
     lfs_mkdir(&state.lfs, parent);
     return;
@@ -1091,12 +1801,86 @@ std::string_view to_string_view(int32_t ptr, int32_t len) {
                           static_cast<std::size_t>(len)};
 }
 
+// Creates or replaces a file, including any missing parent directories
+__wasi_errno_t install_file(const char* path, const void* data,
+                            const lfs_size_t size) {
+  mkdirp(path);
+  state.dentries.invalidate(path);
+  RETURN_IF_WASI_ERR(state.forget_lazy_file(path));
+
+  lfs_file_t file;
+  RETURN_IF_LFS_ERR(lfs_file_open(&state.lfs, &file, path,
+                                  LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC));
+  const auto written = lfs_file_write(&state.lfs, &file, data, size);
+  const auto closed = lfs_file_close(&state.lfs, &file);
+  RETURN_IF_LFS_ERR(written);
+  RETURN_IF_LFS_ERR(closed);
+  return __WASI_ERRNO_SUCCESS;
+}
+
+// Populates an empty descriptor table with stdio and the preopens
+void install_fds() {
+  for (std::size_t i = 0; i < state.preopens.size(); ++i) {
+    const auto fd = static_cast<__wasi_fd_t>(i + 3);
+    state.fds.install(fd, make_preopen_fd(state.preopens[i]));
+  }
+
+  state.fds.install(0, make_stream_fd(__WASI_RIGHTS_FD_READ));
+  state.fds.install(1, make_stream_fd(__WASI_RIGHTS_FD_WRITE));
+  state.fds.install(2, make_stream_fd(__WASI_RIGHTS_FD_WRITE));
+}
+
 }  // namespace
 
 int32_t EXPORT(allocate)(int32_t size) {
   return reinterpret_cast<int32_t>(::malloc(size));
 }
 
+void EXPORT(deallocate)(int32_t ptr) { ::free(reinterpret_cast<void*>(ptr)); }
+
+int32_t EXPORT(write_file)(int32_t arg0, int32_t arg1, int32_t arg2,
+                           int32_t arg3) {
+  const std::string path{to_string_view(arg0, arg1)};
+  return install_file(path.c_str(), reinterpret_cast<const void*>(arg2), arg3);
+}
+
+int32_t EXPORT(file_begin)(int32_t arg0, int32_t arg1, int32_t arg2) {
+  const std::string path{to_string_view(arg0, arg1)};
+  mkdirp(path.c_str());
+  return state.ingest_begin(path.c_str(), reinterpret_cast<int32_t*>(arg2));
+}
+
+int32_t EXPORT(file_append)(int32_t arg0, int32_t arg1, int32_t arg2) {
+  return state.ingest_write(arg0, reinterpret_cast<const void*>(arg1), arg2);
+}
+
+int32_t EXPORT(file_end)(int32_t arg0) { return state.ingest_end(arg0); }
+
+int32_t EXPORT(spool_begin)(int32_t arg0) {
+  return state.spool_begin(reinterpret_cast<int32_t*>(arg0));
+}
+
+int32_t EXPORT(spool_read)(int32_t arg0, int32_t arg1, int32_t arg2,
+                           int32_t arg3, int32_t arg4) {
+  return state.spool_read(arg0, arg1, reinterpret_cast<void*>(arg2), arg3,
+                          reinterpret_cast<__wasi_size_t*>(arg4));
+}
+
+int32_t EXPORT(image_load)(int32_t arg0, int32_t arg1) {
+  return state.image_load(reinterpret_cast<uint8_t*>(arg0), arg1);
+}
+
+int32_t EXPORT(image_attach_base)() { return state.image_attach_base(); }
+
+int32_t EXPORT(block_count)() { return state.bd.capacity(); }
+
+int32_t EXPORT(image_save)(int32_t arg0) {
+  std::size_t size = 0;
+  auto* image = state.image_save(&size);
+  *reinterpret_cast<int32_t*>(arg0) = size;
+  return reinterpret_cast<int32_t>(image);
+}
+
 int32_t EXPORT(initialize_internal)(int32_t arg0, int32_t arg1) {
   const auto json = to_string_view(arg0, arg1);
 
@@ -1105,34 +1889,64 @@ int32_t EXPORT(initialize_internal)(int32_t arg0, int32_t arg1) {
 
   REQUIRE(d.HasMember("preopens"));
   for (const auto& preopen : d["preopens"].GetArray()) {
-    const auto new_fd = state.preopens.size() + 3;
     state.preopens.emplace_back(preopen.GetString());
-    state.fds.emplace(new_fd, make_preopen_fd(state.preopens.back()));
+  }
+
+  if (d.HasMember("syncMode")) {
+    const std::string_view mode = d["syncMode"].GetString();
+    REQUIRE(mode == "strict" || mode == "write-back");
+    state.sync_mode =
+        mode == "write-back" ? SyncMode::kWriteBack : SyncMode::kStrict;
+  }
+  if (d.HasMember("dirtyThreshold")) {
+    state.dirty_threshold = d["dirtyThreshold"].GetUint();
   }
 
   REQUIRE(d.HasMember("fs"));
   for (const auto& m : d["fs"].GetObject()) {
-    const auto* path = m.name.GetString();
-    mkdirp(path);
+    REQUIRE(install_file(m.name.GetString(), m.value.GetString(),
+                         m.value.GetStringLength()) == __WASI_ERRNO_SUCCESS);
+  }
 
-    lfs_file_t file;
-    LFS_REQUIRE(lfs_file_open(&state.lfs, &file, path,
-                              LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXCL));
-    LFS_REQUIRE(lfs_file_write(&state.lfs, &file, m.value.GetString(),
-                               m.value.GetStringLength()));
-    LFS_REQUIRE(lfs_file_close(&state.lfs, &file));
+  if (d.HasMember("lazy")) {
+    for (const auto& m : d["lazy"].GetObject()) {
+      mkdirp(m.name.GetString());
+      REQUIRE(state.add_lazy_file(m.name.GetString(), m.value.GetUint()) ==
+              __WASI_ERRNO_SUCCESS);
+    }
   }
 
-  REQUIRE(state.fds.emplace(0, make_stream_fd(__WASI_RIGHTS_FD_READ)).second);
-  REQUIRE(state.fds.emplace(1, make_stream_fd(__WASI_RIGHTS_FD_WRITE)).second);
-  REQUIRE(state.fds.emplace(2, make_stream_fd(__WASI_RIGHTS_FD_WRITE)).second);
+  install_fds();
+
+  if (d.HasMember("reusable") && d["reusable"].GetBool()) {
+    state.checkpoint();
+  }
 
   return __WASI_ERRNO_SUCCESS;
 }
 
+int32_t EXPORT(stats)(int32_t arg0) {
+  return state.stats(reinterpret_cast<Stats*>(arg0));
+}
+
+int32_t EXPORT(flush)() { return state.sync_all(); }
+
+int32_t EXPORT(reset)() {
+  RETURN_IF_WASI_ERR(state.reset());
+  install_fds();
+  return __WASI_ERRNO_SUCCESS;
+}
+
+// Set once main() has formatted and mounted the filesystem. The published
+// memfs.wasm is snapshotted after that point, so its instances come up
+// initialized and must not run _start again.
+bool initialized = false;
+
+int32_t EXPORT(is_initialized)() { return initialized; }
+
 int main() {
-  LFS_REQUIRE(lfs_rambd_create(&state.cfg));
   LFS_REQUIRE(lfs_format(&state.lfs, &state.cfg));
   LFS_REQUIRE(lfs_mount(&state.lfs, &state.cfg));
+  initialized = true;
   return 0;
 }
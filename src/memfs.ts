@@ -12,13 +12,220 @@ export interface _FS {
   [filename: string]: string
 }
 
+/**
+ * Sizes of files whose contents are provided on demand by a {@link FSLoader},
+ * keyed by absolute path
+ * @public
+ */
+export interface FSManifest {
+  [filename: string]: number
+}
+
+/**
+ * Returns the contents of a file from a {@link FSManifest}, called the first
+ * time the file is opened
+ * @public
+ */
+export type FSLoader = (path: string) => Uint8Array
+
+/**
+ * Controls when file state written by the application is committed to the
+ * filesystem, see {@link WASIOptions.fsSyncMode}
+ * @public
+ */
+export type SyncMode = 'strict' | 'write-back'
+
+/**
+ * Counters and sizes of the filesystem, see {@link MemFS.stats}. Counters are
+ * cumulative since the filesystem was created.
+ * @public
+ */
+export interface MemFSStats {
+  /**
+   * Block device reads, littlefs only reads blocks that missed its caches
+   */
+  deviceReads: number
+  deviceReadBytes: number
+  /**
+   * Reads of blocks served by the base image of an overlay mount
+   */
+  baseImageReads: number
+  deviceProgs: number
+  deviceProgBytes: number
+  deviceErases: number
+  blockCount: number
+  /**
+   * Blocks referenced by the filesystem
+   */
+  blocksInUse: number
+  /**
+   * Blocks held in memory, including erased blocks kept for reuse
+   */
+  blocksAllocated: number
+  /**
+   * Copies of blocks kept to restore the filesystem on {@link MemFS.reset}
+   */
+  blocksRetained: number
+  /**
+   * Size of the filesystem's memory, see {@link MemFS.memorySize}
+   */
+  memoryBytes: number
+  /**
+   * Memory above the static data and stack. Memory isn't given back once it was grown, so this approximates the heap's
+   * high-water mark rather than what is currently allocated.
+   */
+  dynamicMemoryBytes: number
+}
+
+// field order of Stats in memfs.cc, every field is a uint64_t
+const STATS_FIELDS: Array<keyof MemFSStats> = [
+  'deviceReads',
+  'deviceReadBytes',
+  'baseImageReads',
+  'deviceProgs',
+  'deviceProgBytes',
+  'deviceErases',
+  'blockCount',
+  'blocksInUse',
+  'blocksAllocated',
+  'blocksRetained',
+  'memoryBytes',
+  'dynamicMemoryBytes',
+]
+
+// see ImageHeader in block_device.h
+const IMAGE_MAGIC = 0x49534657
+const IMAGE_VERSION = 1
+const IMAGE_HEADER_SIZE = 20
+const BLOCK_SIZE = 4096
+
+// size of the memfs buffer file contents pass through in addFile
+const INGEST_CHUNK_SIZE = 64 * 1024
+
+/**
+ * Index over a filesystem image that serves block reads for overlay mounts,
+ * built once per image and shared by every MemFS using it
+ */
+class BaseImage {
+  static #cache = new WeakMap<Uint8Array, BaseImage>()
+
+  static get(image: Uint8Array): BaseImage {
+    let base = BaseImage.#cache.get(image)
+    if (!base) {
+      base = new BaseImage(image)
+      BaseImage.#cache.set(image, base)
+    }
+    return base
+  }
+
+  #image: Uint8Array
+  // number of blocks of the device the image was built for
+  readonly blockCount: number
+  // byte offset of every block in the image, -1 if absent
+  #offsets: Int32Array
+
+  constructor(image: Uint8Array) {
+    const header = new DataView(
+      image.buffer,
+      image.byteOffset,
+      image.byteLength
+    )
+    const magic = header.getUint32(0, true)
+    const version = header.getUint32(4, true)
+    const blockSize = header.getUint32(8, true)
+    const blockCount = header.getUint32(12, true)
+    const imageBlocks = header.getUint32(16, true)
+    const dataOffset = IMAGE_HEADER_SIZE + imageBlocks * 4
+    if (
+      magic !== IMAGE_MAGIC ||
+      version !== IMAGE_VERSION ||
+      blockSize !== BLOCK_SIZE ||
+      image.byteLength !== dataOffset + imageBlocks * BLOCK_SIZE
+    ) {
+      throw new Error('invalid filesystem image')
+    }
+
+    this.#image = image
+    this.blockCount = blockCount
+    this.#offsets = new Int32Array(blockCount).fill(-1)
+    for (let i = 0; i < imageBlocks; ++i) {
+      const block = header.getUint32(IMAGE_HEADER_SIZE + i * 4, true)
+      if (block >= blockCount) {
+        throw new Error('invalid filesystem image')
+      }
+      this.#offsets[block] = dataOffset + i * BLOCK_SIZE
+    }
+  }
+
+  read(block: number, off: number, dst: Uint8Array, size: number): boolean {
+    const offset = block < this.#offsets.length ? this.#offsets[block] : -1
+    if (offset < 0) {
+      return false
+    }
+    const start = offset + off
+    dst.set(this.#image.subarray(start, start + size))
+    return true
+  }
+}
+
+/**
+ * Anonymous file in a {@link MemFS} that isn't visible to the application,
+ * see {@link MemFS.createSpool}
+ */
+export interface Spool {
+  append(data: Uint8Array): void
+  /**
+   * Reads up to `dst.byteLength` bytes at `offset`, returns the number of
+   * bytes read
+   */
+  read(offset: number, dst: Uint8Array): number
+  /**
+   * Removes the spool and releases its blocks
+   */
+  close(): void
+}
+
+export interface MemFSOptions {
+  syncMode?: SyncMode
+  dirtyThreshold?: number
+  image?: Uint8Array
+  /**
+   * Image mounted as a read-only base layer, only the blocks an instance
+   * modifies are copied into its memory
+   */
+  baseImage?: Uint8Array
+  manifest?: FSManifest
+  loader?: FSLoader
+  /**
+   * Track modified blocks so the filesystem can be returned to its initial
+   * contents with {@link MemFS.reset}
+   */
+  reusable?: boolean
+}
+
 export class MemFS {
   exports: wasi.SnapshotPreview1
 
   #instance: WebAssembly.Instance
   #hostMemory?: WebAssembly.Memory
+  #base?: BaseImage
+  #loader?: FSLoader
+  #ingestBuffer?: number
+  #spoolReadAddr?: number
+  // file currently being copied in by lazy_load, which is called once per
+  // chunk
+  #loading?: { path: string; contents: Uint8Array }
+
+  constructor(preopens: Array<string>, fs: _FS, options: MemFSOptions = {}) {
+    if (options.image && options.baseImage) {
+      throw new Error('image and baseImage are mutually exclusive')
+    }
+    if (options.manifest && !options.loader) {
+      throw new Error('manifest requires a loader')
+    }
+    this.#base = options.baseImage && BaseImage.get(options.baseImage)
+    this.#loader = options.loader
 
-  constructor(preopens: Array<string>, fs: _FS) {
     this.#instance = new WebAssembly.Instance(wasm, {
       internal: {
         now_ms: () => Date.now(),
@@ -53,6 +260,43 @@ export class MemFS {
           )
           dst.set(src)
         },
+        copy_out_batch: (regionsAddr: number, count: number) => {
+          const src = new Uint8Array(this.#getInternalView().buffer)
+          const dst = new Uint8Array(this.#hostMemory!.buffer)
+          this.#copyRegions(src, dst, regionsAddr, count)
+        },
+        copy_in_batch: (regionsAddr: number, count: number) => {
+          const src = new Uint8Array(this.#hostMemory!.buffer)
+          const dst = new Uint8Array(this.#getInternalView().buffer)
+          this.#copyRegions(src, dst, regionsAddr, count)
+        },
+        base_read: (
+          block: number,
+          off: number,
+          dstAddr: number,
+          size: number
+        ): number => {
+          const dst = new Uint8Array(
+            this.#getInternalView().buffer,
+            dstAddr,
+            size
+          )
+          return this.#base?.read(block, off, dst, size) ? 1 : 0
+        },
+        lazy_load: (
+          pathAddr: number,
+          pathLen: number,
+          off: number,
+          dstAddr: number,
+          size: number
+        ): number => {
+          const memory = this.#getInternalView().buffer
+          const path = new TextDecoder().decode(
+            new Uint8Array(memory, pathAddr, pathLen)
+          )
+          const dst = new Uint8Array(memory, dstAddr, size)
+          return this.#lazyLoad(path, off, dst)
+        },
       },
       wasi_snapshot_preview1: {
         proc_exit: (_: number) => {},
@@ -63,10 +307,43 @@ export class MemFS {
     })
     this.exports = this.#instance.exports as unknown as wasi.SnapshotPreview1
 
-    const start = this.#instance.exports._start as Function
-    start()
+    // the published memfs.wasm is pre-initialized, see tools/snapshot.mjs
+    const isInitialized = this.#instance.exports.is_initialized as Function
+    if (!isInitialized()) {
+      const start = this.#instance.exports._start as Function
+      start()
+    }
+
+    if (options.image) {
+      this.#loadImage(options.image)
+    }
+    if (this.#base) {
+      // blocks are read from the base by number, it has to describe a
+      // device of the same size
+      const blockCount = (this.#instance.exports.block_count as Function)()
+      if (this.#base.blockCount !== blockCount) {
+        throw new Error(
+          `base image was built for ${this.#base.blockCount} blocks, the filesystem has ${blockCount}`
+        )
+      }
+      const image_attach_base = this.#instance.exports
+        .image_attach_base as Function
+      const result = image_attach_base()
+      if (result !== wasi.Result.SUCCESS) {
+        throw new Error(`failed to mount base image: ${result}`)
+      }
+    }
 
-    const data = new TextEncoder().encode(JSON.stringify({ preopens, fs }))
+    const data = new TextEncoder().encode(
+      JSON.stringify({
+        preopens,
+        fs,
+        syncMode: options.syncMode,
+        dirtyThreshold: options.dirtyThreshold,
+        lazy: options.manifest,
+        reusable: options.reusable,
+      })
+    )
 
     const initialize_internal = this.#instance.exports
       .initialize_internal as Function
@@ -77,11 +354,255 @@ export class MemFS {
     this.#hostMemory = hostMemory
   }
 
+  /**
+   * Creates or replaces a file, including any missing parent directories.
+   * Contents are written in chunks through a fixed size buffer, memory use
+   * doesn't depend on the size of the file.
+   */
+  async addFile(
+    path: string,
+    data: Uint8Array | ReadableStream<Uint8Array>
+  ): Promise<void> {
+    const exports = this.#instance.exports
+    const encodedPath = new TextEncoder().encode(path)
+    const pathAddr = this.#copyFrom(encodedPath)
+    const handleAddr = (exports.allocate as Function)(4)
+    const begin = (exports.file_begin as Function)(
+      pathAddr,
+      encodedPath.byteLength,
+      handleAddr
+    )
+    const handle = this.#getInternalView().getInt32(handleAddr, true)
+    ;(exports.deallocate as Function)(handleAddr)
+    ;(exports.deallocate as Function)(pathAddr)
+    if (begin !== wasi.Result.SUCCESS) {
+      throw new Error(`failed to create ${path}: ${begin}`)
+    }
+
+    let result: number
+    try {
+      if (data instanceof Uint8Array) {
+        this.#appendFile(path, handle, data)
+      } else {
+        const reader = data.getReader()
+        for (;;) {
+          const { done, value } = await reader.read()
+          if (done) break
+          this.#appendFile(path, handle, value)
+        }
+      }
+    } finally {
+      result = (exports.file_end as Function)(handle)
+    }
+    if (result !== wasi.Result.SUCCESS) {
+      throw new Error(`failed to write ${path}: ${result}`)
+    }
+  }
+
+  /**
+   * Creates a {@link Spool}, which keeps data in the filesystem's block store
+   * instead of on the JavaScript heap
+   */
+  createSpool(): Spool {
+    const exports = this.#instance.exports
+    const handleAddr = (exports.allocate as Function)(4)
+    const begin = (exports.spool_begin as Function)(handleAddr)
+    const handle = this.#getInternalView().getInt32(handleAddr, true)
+    ;(exports.deallocate as Function)(handleAddr)
+    if (begin !== wasi.Result.SUCCESS) {
+      throw new Error(`failed to create spool: ${begin}`)
+    }
+
+    return {
+      append: (data) => this.#appendFile('spool', handle, data),
+      read: (offset, dst) => this.#readSpool(handle, offset, dst),
+      close: () => {
+        const result = (exports.file_end as Function)(handle)
+        if (result !== wasi.Result.SUCCESS) {
+          throw new Error(`failed to remove spool: ${result}`)
+        }
+      },
+    }
+  }
+
+  /**
+   * Serializes the current filesystem contents into an image that can be
+   * passed as {@link WASIOptions.fsImage}
+   */
+  saveImage(): Uint8Array {
+    const exports = this.#instance.exports
+    const sizeAddr = (exports.allocate as Function)(4)
+    const imageAddr = (exports.image_save as Function)(sizeAddr)
+    const size = this.#getInternalView().getUint32(sizeAddr, true)
+    ;(exports.deallocate as Function)(sizeAddr)
+    if (imageAddr === 0) {
+      throw new Error('failed to save filesystem image')
+    }
+
+    const image = new Uint8Array(size)
+    image.set(new Uint8Array(this.#getInternalView().buffer, imageAddr, size))
+    ;(exports.deallocate as Function)(imageAddr)
+    return image
+  }
+
+  /**
+   * Returns the filesystem and descriptor table to their state right after
+   * construction, requires {@link MemFSOptions.reusable}
+   */
+  reset() {
+    const result = (this.#instance.exports.reset as Function)()
+    if (result !== wasi.Result.SUCCESS) {
+      throw new Error(`failed to reset filesystem: ${result}`)
+    }
+    this.#hostMemory = undefined
+  }
+
+  /**
+   * Commits all pending writes in write-back mode
+   */
+  flush(): number {
+    return (this.#instance.exports.flush as Function)()
+  }
+
+  /**
+   * Returns block device and allocation statistics of the filesystem
+   */
+  stats(): MemFSStats {
+    const exports = this.#instance.exports
+    const statsAddr = (exports.allocate as Function)(STATS_FIELDS.length * 8)
+    const result = (exports.stats as Function)(statsAddr)
+    const view = this.#getInternalView()
+    const stats = Object.fromEntries(
+      STATS_FIELDS.map((field, i) => [
+        field,
+        Number(view.getBigUint64(statsAddr + i * 8, true)),
+      ])
+    ) as unknown as MemFSStats
+    ;(exports.deallocate as Function)(statsAddr)
+    if (result !== wasi.Result.SUCCESS) {
+      throw new Error(`failed to collect filesystem stats: ${result}`)
+    }
+    return stats
+  }
+
+  /**
+   * Size of the filesystem's memory in bytes. Memory isn't given back once it
+   * was grown, so this is the peak since the filesystem was created.
+   */
+  get memorySize(): number {
+    const memory = this.#instance.exports.memory as WebAssembly.Memory
+    return memory.buffer.byteLength
+  }
+
+  #lazyLoad(path: string, off: number, dst: Uint8Array): number {
+    if (this.#loading?.path !== path) {
+      try {
+        const contents = this.#loader!(path)
+        if (!(contents instanceof Uint8Array)) {
+          throw new Error('loader did not return a Uint8Array')
+        }
+        this.#loading = { path, contents }
+      } catch (e) {
+        console.error(`failed to load ${path}: ${e}`)
+        return -1
+      }
+    }
+
+    const { contents } = this.#loading!
+    const chunk = contents.subarray(off, off + dst.byteLength)
+    dst.set(chunk)
+    if (off + chunk.byteLength >= contents.byteLength) {
+      this.#loading = undefined
+    }
+    return chunk.byteLength
+  }
+
+  #appendFile(path: string, handle: number, data: Uint8Array) {
+    const exports = this.#instance.exports
+    this.#ingestBuffer ??= (exports.allocate as Function)(INGEST_CHUNK_SIZE)
+    const buffer = this.#ingestBuffer!
+
+    for (let off = 0; off < data.byteLength; off += INGEST_CHUNK_SIZE) {
+      const chunk = data.subarray(off, off + INGEST_CHUNK_SIZE)
+      new Uint8Array(this.#getInternalView().buffer, buffer).set(chunk)
+      const result = (exports.file_append as Function)(
+        handle,
+        buffer,
+        chunk.byteLength
+      )
+      if (result !== wasi.Result.SUCCESS) {
+        throw new Error(`failed to write ${path}: ${result}`)
+      }
+    }
+  }
+
+  #readSpool(handle: number, offset: number, dst: Uint8Array): number {
+    const exports = this.#instance.exports
+    this.#ingestBuffer ??= (exports.allocate as Function)(INGEST_CHUNK_SIZE)
+    this.#spoolReadAddr ??= (exports.allocate as Function)(4)
+    const buffer = this.#ingestBuffer!
+
+    let read = 0
+    while (read < dst.byteLength) {
+      const size = Math.min(dst.byteLength - read, INGEST_CHUNK_SIZE)
+      const result = (exports.spool_read as Function)(
+        handle,
+        offset + read,
+        buffer,
+        size,
+        this.#spoolReadAddr
+      )
+      if (result !== wasi.Result.SUCCESS) {
+        throw new Error(`failed to read spool: ${result}`)
+      }
+      const view = this.#getInternalView()
+      const bytes = view.getUint32(this.#spoolReadAddr!, true)
+      dst.set(new Uint8Array(view.buffer, buffer, bytes), read)
+      read += bytes
+      if (bytes < size) {
+        break
+      }
+    }
+    return read
+  }
+
   #getInternalView(): DataView {
     const memory = this.#instance.exports.memory as WebAssembly.Memory
     return new DataView(memory.buffer)
   }
 
+  /**
+   * Performs the copies described by `count` consecutive `{ src_addr, dst_addr, size }` int32 triples starting at
+   * `regionsAddr` in memfs memory
+   */
+  #copyRegions(
+    src: Uint8Array,
+    dst: Uint8Array,
+    regionsAddr: number,
+    count: number
+  ) {
+    const regions = new Int32Array(
+      this.#getInternalView().buffer,
+      regionsAddr,
+      count * 3
+    )
+    for (let i = 0; i < regions.length; i += 3) {
+      const srcAddr = regions[i]
+      const dstAddr = regions[i + 1]
+      const size = regions[i + 2]
+      dst.set(src.subarray(srcAddr, srcAddr + size), dstAddr)
+    }
+  }
+
+  #loadImage(image: Uint8Array) {
+    // memfs takes ownership of the copy and mounts its blocks in place
+    const image_load = this.#instance.exports.image_load as Function
+    const result = image_load(this.#copyFrom(image), image.byteLength)
+    if (result !== wasi.Result.SUCCESS) {
+      throw new Error(`failed to load filesystem image: ${result}`)
+    }
+  }
+
   #copyFrom(src: Uint8Array): number {
     const dstAddr = (this.#instance.exports.allocate as Function)(
       src.byteLength
@@ -92,3 +613,102 @@ export class MemFS {
     return dstAddr
   }
 }
+
+/**
+ * @public
+ */
+export interface MemFSPoolOptions {
+  /**
+   * See {@link WASIOptions.preopens}
+   */
+  preopens?: string[]
+  /**
+   * See {@link WASIOptions.fsSyncMode}
+   */
+  syncMode?: SyncMode
+  /**
+   * See {@link WASIOptions.fsDirtyThreshold}
+   */
+  dirtyThreshold?: number
+  /**
+   * See {@link WASIOptions.fsImage}
+   */
+  image?: Uint8Array
+  /**
+   * See {@link WASIOptions.fsBaseImage}
+   */
+  baseImage?: Uint8Array
+  /**
+   * See {@link WASIOptions.fsManifest}
+   */
+  manifest?: FSManifest
+  /**
+   * See {@link WASIOptions.fsLoader}
+   */
+  loader?: FSLoader
+  /**
+   * Number of idle filesystems kept for reuse
+   *
+   * @defaultValue `16`
+   *
+   */
+  maxIdle?: number
+
+  /**
+   * @internal
+   */
+  fs?: _FS
+}
+
+/**
+ * Reuses filesystems across {@link WASI} instances. A filesystem returned
+ * with {@link MemFSPool.release} is reset by restoring only the blocks the
+ * previous program modified, which is far cheaper than building a new one.
+ *
+ * ```ts
+ * const memfs = pool.acquire()
+ * try {
+ *   const wasi = new WASI({ memfs })
+ *   const instance = new WebAssembly.Instance(module, {
+ *     wasi_snapshot_preview1: wasi.wasiImport,
+ *   })
+ *   await wasi.start(instance)
+ * } finally {
+ *   pool.release(memfs)
+ * }
+ * ```
+ *
+ * @public
+ */
+export class MemFSPool {
+  #options: MemFSPoolOptions
+  #idle: Array<MemFS> = []
+
+  constructor(options: MemFSPoolOptions = {}) {
+    this.#options = options
+  }
+
+  acquire(): MemFS {
+    const options = this.#options
+    return (
+      this.#idle.pop() ??
+      new MemFS(options.preopens ?? [], options.fs ?? {}, {
+        syncMode: options.syncMode,
+        dirtyThreshold: options.dirtyThreshold,
+        image: options.image,
+        baseImage: options.baseImage,
+        manifest: options.manifest,
+        loader: options.loader,
+        reusable: true,
+      })
+    )
+  }
+
+  release(memfs: MemFS) {
+    if (this.#idle.length >= (this.#options.maxIdle ?? 16)) {
+      return
+    }
+    memfs.reset()
+    this.#idle.push(memfs)
+  }
+}
@@ -0,0 +1,202 @@
+import type { SnapshotPreview1 } from './snapshot_preview1'
+
+/**
+ * Number of buckets of {@link ImportMetrics.histogram}
+ * @public
+ */
+export const HISTOGRAM_BUCKETS = 32
+
+/**
+ * Statistics of a single import, see {@link WASIOptions.metrics}
+ * @public
+ */
+export interface ImportMetrics {
+  calls: number
+  /**
+   * Calls that returned an error, by errno
+   */
+  errors: Record<number, number>
+  /**
+   * Bytes read or written by successful calls of `fd_read`, `fd_write`, `fd_pread`, `fd_pwrite`, `fd_readdir` and
+   * `random_get`
+   */
+  bytes: number
+  /**
+   * Time spent in the import until it returned, excluding the time the application was suspended
+   */
+  totalMs: number
+  /**
+   * Calls by duration, bucket 0 counts calls that took less than a microsecond and bucket `i` those that took at
+   * least `2^(i-1)` and less than `2^i` microseconds
+   */
+  histogram: Array<number>
+}
+
+/**
+ * Statistics collected by {@link WASI.start}, see {@link WASIOptions.metrics}
+ * @public
+ */
+export interface WASIMetrics {
+  imports: Record<string, ImportMetrics>
+  /**
+   * Wall time of {@link WASI.start}
+   */
+  totalMs: number
+  /**
+   * Time spent in the application outside of imports
+   */
+  guestMs: number
+  /**
+   * Time spent in imports outside of the filesystem, in JavaScript
+   */
+  trampolineMs: number
+  /**
+   * Time spent in the filesystem
+   */
+  memfsMs: number
+  /**
+   * Time the application was suspended waiting for a stream
+   */
+  waitMs: number
+}
+
+// performance.now() has sub-millisecond resolution where it exists, Workers
+// only advance either clock on I/O
+const performance = (globalThis as any).performance
+/**
+ * @internal
+ */
+export const now: () => number = performance
+  ? () => performance.now()
+  : () => Date.now()
+
+type ReadU32 = (addr: number) => number
+
+// bytes moved by a successful call, from its arguments after it returned
+const BYTES_MOVED: Record<string, (args: any[], read: ReadU32) => number> = {
+  fd_read: (args, read) => read(args[3]),
+  fd_write: (args, read) => read(args[3]),
+  fd_pread: (args, read) => read(args[4]),
+  fd_pwrite: (args, read) => read(args[4]),
+  fd_readdir: (args, read) => read(args[4]),
+  random_get: (args) => args[1],
+}
+
+const bucketOf = (ms: number): number => {
+  const us = Math.floor(ms * 1000)
+  return Math.min(us > 0 ? 32 - Math.clz32(us) : 0, HISTOGRAM_BUCKETS - 1)
+}
+
+/**
+ * @internal
+ */
+export class Metrics {
+  #imports: Record<string, ImportMetrics> = {}
+  #startedMs = 0
+  #totalMs = 0
+  #importMs = 0
+  #memfsMs = 0
+  #waitMs = 0
+
+  begin() {
+    this.#startedMs = now()
+  }
+
+  end() {
+    this.#totalMs += now() - this.#startedMs
+  }
+
+  /**
+   * Counts the calls of the import `name`, `read` reads the application's
+   * memory to tell how many bytes were moved
+   */
+  wrapImport(name: string, f: Function, read: ReadU32): Function {
+    const metrics = (this.#imports[name] ??= {
+      calls: 0,
+      errors: {},
+      bytes: 0,
+      totalMs: 0,
+      histogram: new Array(HISTOGRAM_BUCKETS).fill(0),
+    })
+    const bytesMoved = BYTES_MOVED[name]
+
+    const settle = (args: any[], result: unknown) => {
+      if (typeof result !== 'number') {
+        return
+      }
+      if (result !== 0) {
+        metrics.errors[result] = (metrics.errors[result] ?? 0) + 1
+      } else if (bytesMoved) {
+        metrics.bytes += bytesMoved(args, read)
+      }
+    }
+
+    return (...args: any[]) => {
+      const started = now()
+      let result: unknown
+      try {
+        result = f(...args)
+        return result
+      } finally {
+        const returned = now()
+        const elapsed = returned - started
+        ++metrics.calls
+        metrics.totalMs += elapsed
+        ++metrics.histogram[bucketOf(elapsed)]
+        this.#importMs += elapsed
+
+        if (result instanceof Promise) {
+          // rejections are handled by whoever awaits the import
+          result.then(
+            (value) => {
+              this.#waitMs += now() - returned
+              settle(args, value)
+            },
+            () => {}
+          )
+        } else {
+          settle(args, result)
+        }
+      }
+    }
+  }
+
+  /**
+   * Returns `exports` with every call timed as filesystem time
+   */
+  wrapMemFS(exports: SnapshotPreview1): SnapshotPreview1 {
+    const wrapped: Record<string, Function> = {}
+    for (const [name, f] of Object.entries(exports)) {
+      if (typeof f !== 'function') continue
+      wrapped[name] = (...args: any[]) => {
+        const started = now()
+        try {
+          return f(...args)
+        } finally {
+          this.#memfsMs += now() - started
+        }
+      }
+    }
+    return wrapped as unknown as SnapshotPreview1
+  }
+
+  snapshot(): WASIMetrics {
+    return {
+      imports: Object.fromEntries(
+        Object.entries(this.#imports).map(([name, metrics]) => [
+          name,
+          {
+            ...metrics,
+            errors: { ...metrics.errors },
+            histogram: [...metrics.histogram],
+          },
+        ])
+      ),
+      totalMs: this.#totalMs,
+      guestMs: Math.max(0, this.#totalMs - this.#importMs - this.#waitMs),
+      trampolineMs: Math.max(0, this.#importMs - this.#memfsMs),
+      memfsMs: this.#memfsMs,
+      waitMs: this.#waitMs,
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#include "path.h"
+
+#include <cstring>
+
+#include "config.h"
+
+__wasi_errno_t canonicalize_path(const std::string_view& dir,
+                                 const std::string_view& path,
+                                 const std::span<char> result) {
+  REQUIRE(result.size() >= canonical_path_size(dir, path));
+  if (path.empty()) {
+    return __WASI_ERRNO_NOENT;
+  }
+  if (path.front() == '/') {
+    return __WASI_ERRNO_NOTCAPABLE;
+  }
+
+  // components are appended as "/name", the root directory is the empty
+  // prefix
+  auto base = dir;
+  while (!base.empty() && base.back() == '/') {
+    base.remove_suffix(1);
+  }
+  memcpy(result.data(), base.data(), base.size());
+  std::size_t size = base.size();
+
+  for (std::size_t begin = 0; begin < path.size();) {
+    auto end = path.find('/', begin);
+    if (end == std::string_view::npos) {
+      end = path.size();
+    }
+    const auto component = path.substr(begin, end - begin);
+    begin = end + 1;
+
+    if (component.empty() || component == ".") {
+      continue;
+    }
+    if (component == "..") {
+      if (size == base.size()) {
+        return __WASI_ERRNO_NOTCAPABLE;
+      }
+      while (result[--size] != '/') {
+      }
+      continue;
+    }
+
+    result[size++] = '/';
+    memcpy(result.data() + size, component.data(), component.size());
+    size += component.size();
+  }
+
+  if (size == 0 || (path.back() == '/' && size > base.size())) {
+    result[size++] = '/';
+  }
+  result[size] = 0;
+  return __WASI_ERRNO_SUCCESS;
+}
+
+std::string_view parent_path(std::string_view path) {
+  while (path.size() > 1 && path.back() == '/') {
+    path.remove_suffix(1);
+  }
+  const auto slash = path.rfind('/');
+  if (slash == 0 || slash == std::string_view::npos) {
+    return "/";
+  }
+  return path.substr(0, slash);
+}
+
+std::string child_path(std::string_view dir, const std::string_view& name) {
+  while (dir.size() > 1 && dir.back() == '/') {
+    dir.remove_suffix(1);
+  }
+  if (name == ".") {
+    return std::string(dir);
+  }
+  if (name == "..") {
+    return std::string(parent_path(dir));
+  }
+
+  std::string result;
+  result.reserve(dir.size() + name.size() + 1);
+  result.append(dir);
+  if (result.empty() || result.back() != '/') {
+    result.push_back('/');
+  }
+  result.append(name);
+  return result;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <wasi/api.h>
+
+#include <span>
+#include <string>
+#include <string_view>
+
+// Upper bound for the size of a path produced by canonicalize_path,
+// including the terminating null
+constexpr std::size_t canonical_path_size(const std::string_view& dir,
+                                          const std::string_view& path) {
+  return dir.size() + path.size() + 2;
+}
+
+// Resolves `path` relative to the canonical absolute directory `dir` into a
+// null terminated canonical path. `.`, `..` and repeated slashes are
+// normalized and a trailing slash is kept, since it requires the path to
+// name a directory. Absolute paths and paths leaving `dir` fail with
+// ENOTCAPABLE.
+__wasi_errno_t canonicalize_path(const std::string_view& dir,
+                                 const std::string_view& path,
+                                 std::span<char> result);
+
+// Canonical path of the directory containing the canonical path `path`, the
+// root is its own parent
+std::string_view parent_path(std::string_view path);
+
+// Canonical path of the entry `name` of the canonical directory `dir`, as
+// returned by lfs_dir_read, including "." and ".."
+std::string child_path(std::string_view dir, const std::string_view& name);
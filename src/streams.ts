@@ -1,3 +1,4 @@
+import type { MemFS, Spool } from './memfs'
 import * as wasi from './snapshot_preview1'
 
 export interface FileDescriptor {
@@ -35,40 +36,119 @@ class ReadableStreamBase {
   async postRun(): Promise<void> {}
 }
 
+// default amount of stdin read ahead for asyncify programs, see
+// WASIOptions.streamStdioReadahead
+export const DEFAULT_STDIN_READAHEAD = 64 * 1024
+
 class AsyncReadableStreamAdapter
   extends ReadableStreamBase
   implements FileDescriptor
 {
-  #pending = new Uint8Array()
   #reader: ReadableStreamDefaultReader
-
-  constructor(reader: ReadableStreamDefaultReader) {
+  #readahead: number
+  #chunks: Array<Uint8Array> = []
+  #buffered = 0
+  #done = false
+  #error?: unknown
+  // pulls chunks in the background until the readahead window is full
+  #filling?: Promise<void>
+  // resolved once a chunk arrives while readv waits for one
+  #waiter?: () => void
+
+  constructor(reader: ReadableStreamDefaultReader, readahead: number) {
     super()
     this.#reader = reader
+    this.#readahead = readahead
+  }
+
+  readv(iovs: Array<Uint8Array>): Promise<number> | number {
+    if (this.#buffered > 0 || this.#done) {
+      // suspending the program costs a full asyncify unwind and rewind, so
+      // whatever is buffered is returned right away
+      const read = this.#readBuffered(iovs)
+      if (this.#readahead > 0) {
+        this.#fill()
+      }
+      return read
+    }
+
+    // underrun
+    const arrived = new Promise<void>((resolve) => (this.#waiter = resolve))
+    this.#fill()
+    return arrived.then(() => this.#readBuffered(iovs))
   }
 
-  async readv(iovs: Array<Uint8Array>): Promise<number> {
+  async preRun(): Promise<void> {
+    if (this.#readahead > 0) {
+      this.#fill()
+    }
+  }
+
+  #readBuffered(iovs: Array<Uint8Array>): number {
+    if (this.#buffered === 0 && this.#error !== undefined) {
+      throw this.#error
+    }
+
     let read = 0
     for (let iov of iovs) {
-      while (iov.byteLength > 0) {
-        // pull only if pending queue is empty
-        if (this.#pending.byteLength === 0) {
-          const result = await this.#reader.read()
-          if (result.done) {
-            return read
-          }
-          this.#pending = result.value
-        }
-        const bytes = Math.min(iov.byteLength, this.#pending.byteLength)
-        iov.set(this.#pending!.subarray(0, bytes))
-        this.#pending = this.#pending!.subarray(bytes)
+      while (iov.byteLength > 0 && this.#chunks.length > 0) {
+        const chunk = this.#chunks[0]
+        const bytes = Math.min(iov.byteLength, chunk.byteLength)
+        iov.set(chunk.subarray(0, bytes))
+        iov = iov.subarray(bytes)
         read += bytes
 
-        iov = iov.subarray(bytes)
+        this.#buffered -= bytes
+        if (bytes === chunk.byteLength) {
+          this.#chunks.shift()
+        } else {
+          this.#chunks[0] = chunk.subarray(bytes)
+        }
+      }
+      if (iov.byteLength > 0) {
+        break
       }
     }
     return read
   }
+
+  #fill() {
+    if (
+      this.#filling ||
+      this.#done ||
+      (this.#buffered > 0 && this.#buffered >= this.#readahead)
+    ) {
+      return
+    }
+
+    this.#filling = (async () => {
+      try {
+        do {
+          const result = await this.#reader.read()
+          if (result.done) {
+            this.#done = true
+          } else if (result.value.byteLength > 0) {
+            this.#chunks.push(result.value)
+            this.#buffered += result.value.byteLength
+          }
+          this.#wake()
+        } while (!this.#done && this.#buffered < this.#readahead)
+      } catch (e) {
+        this.#error = e
+        this.#done = true
+        this.#wake()
+      } finally {
+        this.#filling = undefined
+      }
+    })()
+  }
+
+  #wake() {
+    if (this.#waiter && (this.#buffered > 0 || this.#done)) {
+      this.#waiter()
+      this.#waiter = undefined
+    }
+  }
 }
 
 class WritableStreamBase {
@@ -82,41 +162,125 @@ class WritableStreamBase {
   async postRun(): Promise<void> {}
 }
 
+// default amount of asyncify output that is buffered before the program is
+// suspended to wait for the stream, see WASIOptions.streamStdioHighWaterMark
+export const DEFAULT_STDIO_HIGH_WATER_MARK = 64 * 1024
+// output is collected in chunks of this size before it is written to the
+// stream, larger writes are passed on as they are
+const OUTPUT_CHUNK_SIZE = 16 * 1024
+
 class AsyncWritableStreamAdapter
   extends WritableStreamBase
   implements FileDescriptor
 {
   #writer: WritableStreamDefaultWriter
-
-  constructor(writer: WritableStreamDefaultWriter) {
+  #highWaterMark: number
+  // small writes are staged here, the stream receives an exact size copy
+  // because it may hold on to chunks after the write completed
+  #chunk = new Uint8Array(OUTPUT_CHUNK_SIZE)
+  #chunkUsed = 0
+  // bytes handed to the stream whose write didn't complete yet
+  #inFlight = 0
+  // writes complete in order, so only the last one is awaited
+  #lastWrite?: Promise<void>
+  #flushScheduled = false
+
+  constructor(writer: WritableStreamDefaultWriter, highWaterMark: number) {
     super()
     this.#writer = writer
+    this.#highWaterMark = highWaterMark
   }
 
-  async writev(iovs: Array<Uint8Array>): Promise<number> {
+  writev(iovs: Array<Uint8Array>): Promise<number> | number {
     let written = 0
     for (const iov of iovs) {
       if (iov.byteLength === 0) {
         continue
       }
-      await this.#writer.write(iov)
       written += iov.byteLength
+
+      if (this.#chunkUsed + iov.byteLength > this.#chunk.byteLength) {
+        this.#flush()
+      }
+      if (iov.byteLength > this.#chunk.byteLength) {
+        // iov is a view of the program's memory
+        this.#write(iov.slice())
+        continue
+      }
+      this.#chunk.set(iov, this.#chunkUsed)
+      this.#chunkUsed += iov.byteLength
     }
-    return written
+
+    if (this.#chunkUsed + this.#inFlight < this.#highWaterMark) {
+      // staged output is written once the program yields, e.g. to wait for
+      // stdin, or exits
+      if (this.#chunkUsed > 0 && !this.#flushScheduled) {
+        this.#flushScheduled = true
+        queueMicrotask(() => {
+          this.#flushScheduled = false
+          this.#flush()
+        })
+      }
+      return written
+    }
+
+    this.#flush()
+    if (this.#highWaterMark === 0) {
+      // unbuffered, every write completes before the program continues
+      return this.#lastWrite ? this.#lastWrite.then(() => written) : written
+    }
+    // the program is only suspended if the stream signals backpressure
+    const desiredSize = this.#writer.desiredSize
+    if (desiredSize === null || desiredSize > 0) {
+      return written
+    }
+    return this.#writer.ready.then(() => written)
   }
 
   async close(): Promise<void> {
+    this.#flush()
+    await this.#lastWrite
     await this.#writer.close()
   }
+
+  #flush() {
+    if (this.#chunkUsed === 0) {
+      return
+    }
+    this.#write(this.#chunk.slice(0, this.#chunkUsed))
+    this.#chunkUsed = 0
+  }
+
+  #write(chunk: Uint8Array) {
+    const size = chunk.byteLength
+    this.#inFlight += size
+    // failures surface through the last write, awaited in close
+    this.#lastWrite?.catch(() => {})
+    this.#lastWrite = this.#writer.write(chunk)
+    this.#lastWrite.then(
+      () => (this.#inFlight -= size),
+      () => {}
+    )
+  }
 }
 
+// completed chunks of synchronous programs are handed to the stream once
+// they add up to this many bytes
+const OUTPUT_HIGH_WATER_MARK = 64 * 1024
+
 class SyncWritableStreamAdapter
   extends WritableStreamBase
   implements FileDescriptor
 {
   #writer: WritableStreamDefaultWriter
-  #buffer: Uint8Array = new Uint8Array(4096)
-  #bytesWritten: number = 0
+  #chunk = new Uint8Array(OUTPUT_CHUNK_SIZE)
+  #chunkUsed = 0
+  // filled chunks that weren't written yet, data is never copied again
+  // once it is in a chunk
+  #completed: Array<Uint8Array> = []
+  #completedBytes = 0
+  // writes complete in order, so only the last one is awaited
+  #lastWrite?: Promise<void>
 
   constructor(writer: WritableStreamDefaultWriter) {
     super()
@@ -125,68 +289,144 @@ class SyncWritableStreamAdapter
 
   writev(iovs: Array<Uint8Array>): number {
     let written = 0
-    for (const iov of iovs) {
-      if (iov.byteLength === 0) {
+    for (let iov of iovs) {
+      written += iov.byteLength
+
+      if (iov.byteLength >= OUTPUT_CHUNK_SIZE) {
+        // large writes become a chunk of their own
+        this.#completeChunk()
+        this.#complete(iov.slice())
         continue
       }
 
-      // Check if we're about to overflow the buffer and resize if need be.
-      const requiredCapacity = this.#bytesWritten + iov.byteLength
-      if (requiredCapacity > this.#buffer.byteLength) {
-        let desiredCapacity = this.#buffer.byteLength
-        while (desiredCapacity < requiredCapacity) {
-          desiredCapacity *= 1.5;
+      while (iov.byteLength > 0) {
+        const bytes = Math.min(
+          iov.byteLength,
+          this.#chunk.byteLength - this.#chunkUsed
+        )
+        this.#chunk.set(iov.subarray(0, bytes), this.#chunkUsed)
+        this.#chunkUsed += bytes
+        iov = iov.subarray(bytes)
+        if (this.#chunkUsed === this.#chunk.byteLength) {
+          this.#completeChunk()
         }
-
-        const oldBuffer = this.#buffer
-        this.#buffer = new Uint8Array(desiredCapacity)
-        this.#buffer.set(oldBuffer)
       }
+    }
 
-      this.#buffer.set(iov, this.#bytesWritten)
-      written += iov.byteLength
-      this.#bytesWritten += iov.byteLength
+    // the program can't yield, but chunks handed to the stream now are
+    // ready to be sent as soon as it does
+    if (this.#completedBytes >= OUTPUT_HIGH_WATER_MARK) {
+      this.#flush()
     }
     return written
   }
 
   async postRun(): Promise<void> {
-    const slice = this.#buffer.subarray(0, this.#bytesWritten)
-    await this.#writer.write(slice)
+    this.#completeChunk()
+    this.#flush()
+    await this.#lastWrite
     await this.#writer.close()
   }
+
+  #completeChunk() {
+    if (this.#chunkUsed === 0) {
+      return
+    }
+    this.#complete(this.#chunk.subarray(0, this.#chunkUsed))
+    this.#chunk = new Uint8Array(OUTPUT_CHUNK_SIZE)
+    this.#chunkUsed = 0
+  }
+
+  #complete(chunk: Uint8Array) {
+    this.#completed.push(chunk)
+    this.#completedBytes += chunk.byteLength
+  }
+
+  #flush() {
+    for (const chunk of this.#completed) {
+      // failures surface through the last write, awaited in postRun
+      this.#lastWrite?.catch(() => {})
+      this.#lastWrite = this.#writer.write(chunk)
+    }
+    this.#completed = []
+    this.#completedBytes = 0
+  }
 }
 
+/**
+ * Spills stdin to the filesystem once more than `threshold` bytes have been
+ * buffered, see {@link WASIOptions.stdinSpillThreshold}
+ */
+export interface SpillOptions {
+  memfs: MemFS
+  threshold: number
+}
+
+const EMPTY = new Uint8Array()
+
 class SyncReadableStreamAdapter
   extends ReadableStreamBase
   implements FileDescriptor
 {
-  #buffer?: Uint8Array
   #reader: ReadableStreamDefaultReader
-
-  constructor(reader: ReadableStreamDefaultReader) {
+  #spill?: SpillOptions
+  // chunks are served as they were received rather than concatenated, and
+  // dropped once they were read
+  #chunks: Array<Uint8Array> = []
+  #chunkIndex = 0
+  #chunkOffset = 0
+  // whatever arrives after the spill threshold was reached
+  #spool?: Spool
+  #spoolOffset = 0
+
+  constructor(reader: ReadableStreamDefaultReader, spill?: SpillOptions) {
     super()
     this.#reader = reader
+    this.#spill = spill
   }
 
   readv(iovs: Array<Uint8Array>): number {
     let read = 0
-    for (const iov of iovs) {
-      const bytes = Math.min(iov.byteLength, this.#buffer!.byteLength)
-      if (bytes <= 0) {
-        break;
+    for (let iov of iovs) {
+      while (iov.byteLength > 0 && this.#chunkIndex < this.#chunks.length) {
+        const chunk = this.#chunks[this.#chunkIndex]
+        const bytes = Math.min(
+          iov.byteLength,
+          chunk.byteLength - this.#chunkOffset
+        )
+        iov.set(chunk.subarray(this.#chunkOffset, this.#chunkOffset + bytes))
+        iov = iov.subarray(bytes)
+        read += bytes
+
+        this.#chunkOffset += bytes
+        if (this.#chunkOffset === chunk.byteLength) {
+          this.#chunks[this.#chunkIndex++] = EMPTY
+          this.#chunkOffset = 0
+        }
+      }
+
+      if (iov.byteLength > 0 && this.#spool) {
+        const bytes = this.#spool.read(this.#spoolOffset, iov)
+        this.#spoolOffset += bytes
+        iov = iov.subarray(bytes)
+        read += bytes
+      }
+
+      if (iov.byteLength > 0) {
+        break
       }
-      iov.set(this.#buffer!.subarray(0, bytes))
-      this.#buffer = this.#buffer!.subarray(bytes)
-      read += bytes
     }
     return read
   }
 
-  async preRun(): Promise<void> {
-    const pending: Array<Uint8Array> = []
-    let length = 0
+  close(): void {
+    this.#spool?.close()
+    this.#spool = undefined
+    this.#chunks = []
+  }
 
+  async preRun(): Promise<void> {
+    let buffered = 0
     for (;;) {
       const result = await this.#reader.read()
       if (result.done) {
@@ -194,47 +434,48 @@ class SyncReadableStreamAdapter
       }
 
       const data = result.value
-      pending.push(data)
-      length += data.length
-    }
-
-    let result = new Uint8Array(length)
-    let offset = 0
-
-    pending.forEach((item) => {
-      result.set(item, offset)
-      offset += item.length
-    })
+      if (this.#spool) {
+        this.#spool.append(data)
+        continue
+      }
 
-    this.#buffer = result
+      this.#chunks.push(data)
+      buffered += data.byteLength
+      if (this.#spill && buffered > this.#spill.threshold) {
+        this.#spool = this.#spill.memfs.createSpool()
+      }
+    }
   }
 }
 
 export const fromReadableStream = (
   stream: ReadableStream | undefined,
-  supportsAsync: boolean
+  supportsAsync: boolean,
+  spill?: SpillOptions,
+  readahead: number = DEFAULT_STDIN_READAHEAD
 ): FileDescriptor => {
   if (!stream) {
     return new DevNull()
   }
 
   if (supportsAsync) {
-    return new AsyncReadableStreamAdapter(stream.getReader())
+    return new AsyncReadableStreamAdapter(stream.getReader(), readahead)
   }
 
-  return new SyncReadableStreamAdapter(stream.getReader())
+  return new SyncReadableStreamAdapter(stream.getReader(), spill)
 }
 
 export const fromWritableStream = (
   stream: WritableStream | undefined,
-  supportsAsync: boolean
+  supportsAsync: boolean,
+  highWaterMark: number = DEFAULT_STDIO_HIGH_WATER_MARK
 ): FileDescriptor => {
   if (!stream) {
     return new DevNull()
   }
 
   if (supportsAsync) {
-    return new AsyncWritableStreamAdapter(stream.getWriter())
+    return new AsyncWritableStreamAdapter(stream.getWriter(), highWaterMark)
   }
 
   return new SyncWritableStreamAdapter(stream.getWriter())
@@ -0,0 +1,323 @@
+import { now } from './metrics'
+
+// see TraceRecorder.save for the layout of a trace
+const TRACE_MAGIC = 0x43525457
+const TRACE_VERSION = 1
+const TRACE_HEADER_SIZE = 20
+const RECORD_HEADER_SIZE = 24
+const POINTER_HEADER_SIZE = 8
+
+// how the memory behind a pointer argument is described in a record
+const POINTER_INPUT = 0
+const POINTER_IOVECS = 1
+const POINTER_OUTPUT = 2
+
+interface PointerArg {
+  kind: number
+  arg: number
+  // argument holding the byte length or iovec count of the pointer
+  lengthArg?: number
+  // fixed size of an output
+  size?: number
+}
+
+const input = (arg: number, lengthArg: number): PointerArg => ({
+  kind: POINTER_INPUT,
+  arg,
+  lengthArg,
+})
+const iovecs = (arg: number, lengthArg: number): PointerArg => ({
+  kind: POINTER_IOVECS,
+  arg,
+  lengthArg,
+})
+const output = (arg: number, size: number): PointerArg => ({
+  kind: POINTER_OUTPUT,
+  arg,
+  size,
+})
+const outputOf = (arg: number, lengthArg: number): PointerArg => ({
+  kind: POINTER_OUTPUT,
+  arg,
+  lengthArg,
+})
+
+// pointer arguments of the imports served by the filesystem, everything a
+// replay needs to call them against its own memory
+const POINTER_ARGS: Record<string, Array<PointerArg>> = {
+  fd_fdstat_get: [output(1, 24)],
+  fd_filestat_get: [output(1, 64)],
+  fd_pread: [iovecs(1, 2), output(4, 4)],
+  fd_prestat_dir_name: [outputOf(1, 2)],
+  fd_prestat_get: [output(1, 8)],
+  fd_pwrite: [iovecs(1, 2), output(4, 4)],
+  fd_read: [iovecs(1, 2), output(3, 4)],
+  fd_readdir: [outputOf(1, 2), output(4, 4)],
+  fd_seek: [output(3, 8)],
+  fd_tell: [output(1, 8)],
+  fd_write: [iovecs(1, 2), output(3, 4)],
+  path_create_directory: [input(1, 2)],
+  path_filestat_get: [input(2, 3), output(4, 64)],
+  path_filestat_set_times: [input(2, 3)],
+  path_link: [input(2, 3), input(5, 6)],
+  path_open: [input(2, 3), output(8, 4)],
+  path_readlink: [input(1, 2), outputOf(3, 4), output(5, 4)],
+  path_remove_directory: [input(1, 2)],
+  path_rename: [input(1, 2), input(4, 5)],
+  path_symlink: [input(0, 1), input(3, 4)],
+  path_unlink_file: [input(1, 2)],
+}
+
+const align4 = (size: number) => (size + 3) & ~3
+
+/**
+ * Records import calls into a preallocated ring buffer, see {@link WASIOptions.trace}. Once the buffer is full the
+ * oldest records are overwritten.
+ * @public
+ */
+export class TraceRecorder {
+  #bytes: Uint8Array
+  #view: DataView
+  #origin = now()
+  #names: Array<string> = []
+  // offsets of the next record and of the oldest one, a record that doesn't
+  // fit before the end of the buffer starts over at offset 0 behind a zero
+  // size marker
+  #head = 0
+  #tail = 0
+  #count = 0
+  #dropped = 0
+
+  /**
+   * @param buffer - the ring buffer, or its size in bytes
+   */
+  constructor(buffer: ArrayBuffer | number) {
+    if (typeof buffer === 'number') {
+      buffer = new ArrayBuffer(buffer)
+    }
+    this.#bytes = new Uint8Array(buffer, 0, buffer.byteLength & ~3)
+    this.#view = new DataView(buffer, 0, this.#bytes.byteLength)
+  }
+
+  /**
+   * Number of records in the buffer
+   */
+  get recorded(): number {
+    return this.#count
+  }
+
+  /**
+   * Number of calls that were overwritten or didn't fit into the buffer
+   */
+  get dropped(): number {
+    return this.#dropped
+  }
+
+  clear() {
+    this.#head = 0
+    this.#tail = 0
+    this.#count = 0
+    this.#dropped = 0
+  }
+
+  /**
+   * Returns the records in the buffer, oldest first, as a trace for `tools/replay.mjs`. All fields are little endian:
+   *
+   * - header: magic `'WTRC'`, version, record count, dropped count and the byte length of the import names, each a
+   *   u32, followed by the names separated by newlines and padded to 4 bytes
+   *
+   * - every record: u32 size, u8 import name index, u8 argument count, u8 pointer count, a reserved byte, u32 mask of
+   *   64-bit arguments, i32 result or -1 if the import threw, f64 start time in milliseconds since the recorder was
+   *   created, the arguments as 4 or 8 bytes each, then for each pointer argument: u8 kind, u8 argument index, u16
+   *   reserved and u32 length, followed by the path bytes padded to 4 bytes for inputs (kind 0) or the u32 length of
+   *   every buffer for iovecs (kind 1). Outputs (kind 2) only give the size the import writes to.
+   */
+  save(): Uint8Array {
+    const names = new TextEncoder().encode(this.#names.join('\n'))
+    const records: Array<Uint8Array> = []
+    let size = TRACE_HEADER_SIZE + align4(names.byteLength)
+    let offset = this.#tail
+    for (let i = 0; i < this.#count; ++i) {
+      const recordSize = this.#view.getUint32(offset, true)
+      records.push(this.#bytes.subarray(offset, offset + recordSize))
+      size += recordSize
+      offset = this.#normalize(offset + recordSize)
+    }
+
+    const trace = new Uint8Array(size)
+    const header = new DataView(trace.buffer)
+    header.setUint32(0, TRACE_MAGIC, true)
+    header.setUint32(4, TRACE_VERSION, true)
+    header.setUint32(8, this.#count, true)
+    header.setUint32(12, this.#dropped, true)
+    header.setUint32(16, names.byteLength, true)
+    trace.set(names, TRACE_HEADER_SIZE)
+    offset = TRACE_HEADER_SIZE + align4(names.byteLength)
+    for (const record of records) {
+      trace.set(record, offset)
+      offset += record.byteLength
+    }
+    return trace
+  }
+
+  /**
+   * Records the calls of the import `name` once they returned, `memory`
+   * returns a view of the application's memory
+   * @internal
+   */
+  wrapImport(name: string, f: Function, memory: () => DataView): Function {
+    let id = this.#names.indexOf(name)
+    if (id < 0) {
+      id = this.#names.push(name) - 1
+    }
+    const pointers = POINTER_ARGS[name] ?? []
+
+    return (...args: any[]) => {
+      const started = now() - this.#origin
+      let result: unknown
+      try {
+        result = f(...args)
+        return result
+      } finally {
+        if (result instanceof Promise) {
+          // rejections are handled by whoever awaits the import
+          result.then(
+            (value) => this.#record(id, args, pointers, value, started, memory),
+            () => this.#record(id, args, pointers, -1, started, memory)
+          )
+        } else {
+          this.#record(id, args, pointers, result, started, memory)
+        }
+      }
+    }
+  }
+
+  #record(
+    id: number,
+    args: any[],
+    pointers: Array<PointerArg>,
+    result: unknown,
+    started: number,
+    memory: () => DataView
+  ) {
+    let size = RECORD_HEADER_SIZE
+    let wide = 0
+    args.forEach((arg, i) => {
+      if (typeof arg === 'bigint') {
+        wide |= 1 << i
+        size += 8
+      } else {
+        size += 4
+      }
+    })
+    const lengths = pointers.map((pointer) =>
+      pointer.lengthArg === undefined ? pointer.size! : args[pointer.lengthArg]
+    )
+    pointers.forEach((pointer, i) => {
+      size += POINTER_HEADER_SIZE
+      if (pointer.kind === POINTER_INPUT) {
+        size += align4(lengths[i])
+      } else if (pointer.kind === POINTER_IOVECS) {
+        size += lengths[i] * 4
+      }
+    })
+    if (size > this.#bytes.byteLength) {
+      ++this.#dropped
+      return
+    }
+
+    const offset = this.#reserve(size)
+    const view = this.#view
+    view.setUint32(offset, size, true)
+    view.setUint8(offset + 4, id)
+    view.setUint8(offset + 5, args.length)
+    view.setUint8(offset + 6, pointers.length)
+    view.setUint8(offset + 7, 0)
+    view.setUint32(offset + 8, wide, true)
+    view.setInt32(offset + 12, typeof result === 'number' ? result : -1, true)
+    view.setFloat64(offset + 16, started, true)
+
+    let at = offset + RECORD_HEADER_SIZE
+    for (const arg of args) {
+      if (typeof arg === 'bigint') {
+        view.setBigUint64(at, BigInt.asUintN(64, arg), true)
+        at += 8
+      } else {
+        view.setInt32(at, arg, true)
+        at += 4
+      }
+    }
+
+    const guest = memory()
+    pointers.forEach((pointer, i) => {
+      const addr = args[pointer.arg]
+      const length = lengths[i]
+      view.setUint8(at, pointer.kind)
+      view.setUint8(at + 1, pointer.arg)
+      view.setUint16(at + 2, 0, true)
+      view.setUint32(at + 4, length, true)
+      at += POINTER_HEADER_SIZE
+      if (pointer.kind === POINTER_INPUT) {
+        this.#bytes.set(new Uint8Array(guest.buffer, addr, length), at)
+        this.#bytes.fill(0, at + length, at + align4(length))
+        at += align4(length)
+      } else if (pointer.kind === POINTER_IOVECS) {
+        // only the buffer sizes, contents don't change how memfs performs
+        for (let j = 0; j < length; ++j) {
+          view.setUint32(at, guest.getUint32(addr + j * 8 + 4, true), true)
+          at += 4
+        }
+      }
+    })
+  }
+
+  // Returns the offset of a record of `size` bytes, dropping the oldest
+  // records it would overwrite
+  #reserve(size: number): number {
+    const capacity = this.#bytes.byteLength
+    if (this.#head + size > capacity) {
+      // the records between head and the end of the buffer are the oldest
+      while (this.#count > 0 && this.#tail >= this.#head) {
+        this.#dropOldest()
+      }
+      if (this.#head + 4 <= capacity) {
+        this.#view.setUint32(this.#head, 0, true)
+      }
+      this.#head = 0
+    }
+    while (
+      this.#count > 0 &&
+      this.#tail >= this.#head &&
+      this.#tail < this.#head + size
+    ) {
+      this.#dropOldest()
+    }
+
+    const offset = this.#head
+    if (this.#count === 0) {
+      this.#tail = offset
+    }
+    this.#head += size
+    ++this.#count
+    return offset
+  }
+
+  #dropOldest() {
+    this.#tail = this.#normalize(
+      this.#tail + this.#view.getUint32(this.#tail, true)
+    )
+    --this.#count
+    ++this.#dropped
+  }
+
+  // Returns where the record following one that ends at `offset` starts
+  #normalize(offset: number): number {
+    if (
+      offset + 4 > this.#bytes.byteLength ||
+      (offset !== this.#head && this.#view.getUint32(offset, true) === 0)
+    ) {
+      return 0
+    }
+    return offset
+  }
+}
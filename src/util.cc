@@ -1,15 +1,95 @@
 #include "util.h"
 
+#include <algorithm>
+
 #include "config.h"
 
-char* CallFrame::alloc(const std::size_t size) {
-  auto* result = tmp_buffer + tmp_offset;
-  tmp_offset += size;
-  REQUIRE(tmp_offset <= sizeof(tmp_buffer));
-  return result;
+ScratchArena& ScratchArena::get() {
+  static ScratchArena arena;
+  return arena;
+}
+
+char* ScratchArena::alloc(const std::size_t size, const std::size_t alignment) {
+  const auto align = [&](const Chunk& chunk, const std::size_t offset) {
+    const auto base = reinterpret_cast<uintptr_t>(chunk.data.get());
+    return ((base + offset + alignment - 1) & ~(alignment - 1)) - base;
+  };
+
+  if (current < chunks.size()) {
+    const auto aligned = align(chunks[current], offset);
+    if (aligned + size <= chunks[current].size) {
+      offset = aligned + size;
+      return chunks[current].data.get() + aligned;
+    }
+    ++current;
+  }
+
+  // chunks after the current one are unused, a chunk that is too small is
+  // replaced along with everything after it
+  const auto required = size + alignment;
+  if (current < chunks.size() && chunks[current].size < required) {
+    chunks.resize(current);
+  }
+  if (current == chunks.size()) {
+    add_chunk(std::max(required, kChunkSize));
+  }
+
+  const auto aligned = align(chunks[current], 0);
+  offset = aligned + size;
+  return chunks[current].data.get() + aligned;
+}
+
+void ScratchArena::release(const Mark& mark) {
+  current = mark.chunk;
+  offset = mark.offset;
+  if (current != 0 || offset != 0) {
+    return;
+  }
+
+  // the next call that needs as much memory fits into a single chunk
+  std::size_t total = 0;
+  for (const auto& chunk : chunks) {
+    total += chunk.size;
+  }
+  if (chunks.size() <= 1 && total <= kMaxRetained) {
+    return;
+  }
+  chunks.clear();
+  add_chunk(std::min(total, kMaxRetained));
+}
+
+void ScratchArena::add_chunk(const std::size_t size) {
+  chunks.push_back(
+      {.data = std::make_unique_for_overwrite<char[]>(size), .size = size});
 }
 
 std::string_view CallFrame::ref_string(int32_t addr, const int32_t len) {
   const auto span = ref_array<char>(addr, len);
   return {span.data(), span.size()};
 }
+
+CopyBatch::CopyBatch(CallFrame& frame, const std::size_t capacity)
+    : regions(frame.alloc_uninitialized<Region>(capacity)) {}
+
+void CopyBatch::add(const int32_t src_addr, const int32_t dst_addr,
+                    const int32_t size) {
+  if (size == 0) {
+    return;
+  }
+  REQUIRE(count < regions.size());
+  regions[count++] = {.src_addr = src_addr, .dst_addr = dst_addr, .size = size};
+}
+
+void CopyBatch::copy_in() {
+  if (count > 0) {
+    copy_in_batch(reinterpret_cast<int32_t>(regions.data()), count);
+  }
+  count = 0;
+}
+
+void CopyBatch::copy_out() {
+  if (count > 0) {
+    copy_out_batch(reinterpret_cast<int32_t>(regions.data()), count);
+  }
+  count = 0;
+}
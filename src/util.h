@@ -1,10 +1,64 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <span>
 #include <string_view>
 #include <type_traits>
+#include <vector>
 
+// Hash for unordered containers keyed by std::string that can be looked up
+// with a std::string_view without allocating
+struct StringHash {
+  using is_transparent = void;
+  std::size_t operator()(const std::string_view& s) const {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+// Bump allocator behind CallFrame. It lives across calls so that its memory
+// is reused, allocations are released in LIFO order when frames end. It
+// grows by adding chunks, which never move, and once every frame has ended
+// they are merged into a single chunk of bounded size.
+class ScratchArena {
+ public:
+  struct Mark {
+    std::size_t chunk = 0;
+    std::size_t offset = 0;
+  };
+
+  char* alloc(std::size_t size, std::size_t alignment);
+  Mark mark() const { return {current, offset}; }
+  void release(const Mark& mark);
+
+  static ScratchArena& get();
+
+ private:
+  static constexpr std::size_t kChunkSize = 64 * 1024;
+  // memory kept once every frame has ended, anything beyond is freed
+  static constexpr std::size_t kMaxRetained = 1024 * 1024;
+
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    std::size_t size;
+  };
+
+  void add_chunk(std::size_t size);
+
+  std::vector<Chunk> chunks;
+  std::size_t current = 0;
+  std::size_t offset = 0;
+};
+
+// Scratch memory for a single exported call, released when the frame ends
 class CallFrame {
  public:
+  CallFrame() : mark(ScratchArena::get().mark()) {}
+  CallFrame(const CallFrame&) = delete;
+  CallFrame& operator=(const CallFrame&) = delete;
+  ~CallFrame() { ScratchArena::get().release(mark); }
+
   template <class T>
   std::span<T> alloc_uninitialized(const std::size_t count);
 
@@ -14,16 +68,28 @@ class CallFrame {
   std::string_view ref_string(const int32_t addr, const int32_t size);
 
  private:
-  char* alloc(const std::size_t size);
+  char* alloc(const std::size_t size, const std::size_t alignment) {
+    return ScratchArena::get().alloc(size, alignment);
+  }
 
-  char tmp_buffer[4096 * 10];
-  int tmp_offset = 0;
+  const ScratchArena::Mark mark;
 };
 
 #define IMPORT(x) \
   __attribute__((__import_module__("internal"), __import_name__(#x))) x
 int32_t IMPORT(copy_out)(int32_t src_addr, int32_t dst_addr, int32_t size);
 int32_t IMPORT(copy_in)(int32_t src_addr, int32_t dst_addr, int32_t size);
+int32_t IMPORT(copy_out_batch)(int32_t regions_addr, int32_t count);
+int32_t IMPORT(copy_in_batch)(int32_t regions_addr, int32_t count);
+// Reads from the shared base image, returns 0 if the image doesn't contain
+// the block
+int32_t IMPORT(base_read)(int32_t block, int32_t off, int32_t dst_addr,
+                          int32_t size);
+// Copies up to `size` bytes at `off` of a lazily populated file into memfs
+// memory, returns the number of bytes copied or -1 if the file can't be
+// loaded
+int32_t IMPORT(lazy_load)(int32_t path_addr, int32_t path_len, int32_t off,
+                          int32_t dst_addr, int32_t size);
 int32_t IMPORT(trace)(int32_t is_error, int32_t addr, int32_t size);
 int32_t IMPORT(now_ms)();
 #undef IMPORT
@@ -47,6 +113,31 @@ class MutableView {
   const int32_t addr;
 };
 
+// Copies between host and memfs memory that are collected while handling a
+// call and then performed with a single import call, regardless of the
+// number of buffers involved
+class CopyBatch {
+ public:
+  CopyBatch(CallFrame& frame, const std::size_t capacity);
+
+  void add(const int32_t src_addr, const int32_t dst_addr, const int32_t size);
+
+  // src_addr refers to host memory and dst_addr to memfs memory
+  void copy_in();
+  // src_addr refers to memfs memory and dst_addr to host memory
+  void copy_out();
+
+ private:
+  struct Region {
+    int32_t src_addr;
+    int32_t dst_addr;
+    int32_t size;
+  };
+
+  std::span<Region> regions;
+  std::size_t count = 0;
+};
+
 template <class T, class U>
 [[nodiscard]] std::span<T> CallFrame::ref_array(const U addr,
                                                 std::size_t const count) {
@@ -61,5 +152,5 @@ template <class T>
     const std::size_t count) {
   static_assert(std::is_trivial_v<T>);
   const auto byte_length = count * sizeof(T);
-  return {reinterpret_cast<T*>(alloc(byte_length)), count};
+  return {reinterpret_cast<T*>(alloc(byte_length, alignof(T))), count};
 }
@@ -0,0 +1,120 @@
+// @ts-check
+import * as fs from 'fs'
+
+const USAGE = `usage: node benchmark-compare.mjs BASELINE RESULTS [options]
+
+Compares the results written by benchmark.test.ts against a baseline and
+exits with status 1 if any benchmark regressed or is missing from RESULTS,
+which it is if it failed.
+
+  --update                 replace BASELINE with RESULTS instead
+  --threshold=PERCENT      allowed change of ops/sec, p50 and peak memory (10)
+  --latency-threshold=PERCENT
+                           allowed change of p99 latency, which is noisier (25)
+`
+
+/**
+ * Metrics compared for every benchmark, and whether larger values are better
+ * @type {Array<{ key: string, higherIsBetter: boolean, tail?: boolean }>}
+ */
+const METRICS = [
+  { key: 'opsPerSec', higherIsBetter: true },
+  { key: 'p50Us', higherIsBetter: false },
+  { key: 'p99Us', higherIsBetter: false, tail: true },
+  { key: 'peakMemoryBytes', higherIsBetter: false },
+]
+
+/** @param {string} path */
+const readResults = (path) => JSON.parse(fs.readFileSync(path, 'utf8'))
+
+/** @param {number} value */
+const formatPercent = (value) =>
+  `${value >= 0 ? '+' : ''}${(value * 100).toFixed(1)}%`
+
+const main = () => {
+  const argv = process.argv.slice(2)
+  const positional = argv.filter((arg) => !arg.startsWith('--'))
+  const flags = Object.fromEntries(
+    argv
+      .filter((arg) => arg.startsWith('--'))
+      .map((arg) => {
+        const [key, value] = arg.slice(2).split('=')
+        return [key, value ?? true]
+      })
+  )
+  if (positional.length !== 2 || flags.help) {
+    process.stderr.write(USAGE)
+    return 2
+  }
+  const [baselinePath, resultsPath] = positional
+
+  const results = readResults(resultsPath)
+  if (flags.update) {
+    fs.copyFileSync(resultsPath, baselinePath)
+    console.log(
+      `${baselinePath}: updated with ${Object.keys(results).length} results`
+    )
+    return 0
+  }
+
+  if (!fs.existsSync(baselinePath)) {
+    console.error(
+      `${baselinePath} doesn't exist, record one from a known good run with --update`
+    )
+    return 2
+  }
+  const baseline = readResults(baselinePath)
+  const threshold = Number(flags.threshold ?? 10) / 100
+  const latencyThreshold = Number(flags['latency-threshold'] ?? 25) / 100
+
+  let regressions = 0
+  for (const [name, current] of Object.entries(results)) {
+    const previous = baseline[name]
+    if (!previous) {
+      console.log(`${name}: new`)
+      continue
+    }
+
+    const lines = []
+    for (const { key, higherIsBetter, tail } of METRICS) {
+      const before = previous[key]
+      const after = current[key]
+      if (typeof before !== 'number' || typeof after !== 'number') continue
+      if (before === 0) continue
+
+      const change = (after - before) / before
+      const worse = higherIsBetter ? -change : change
+      const allowed = tail ? latencyThreshold : threshold
+      let verdict = ''
+      if (worse > allowed) {
+        verdict = '  REGRESSION'
+        ++regressions
+      } else if (-worse > allowed) {
+        verdict = '  improved'
+      }
+      lines.push(
+        `  ${key}: ${before} -> ${after} (${formatPercent(change)})${verdict}`
+      )
+    }
+    console.log(`${name}:\n${lines.join('\n')}`)
+  }
+
+  // benchmarks that failed have no results
+  let missing = 0
+  for (const name of Object.keys(baseline)) {
+    if (!(name in results)) {
+      console.log(`${name}: MISSING from ${resultsPath}`)
+      ++missing
+    }
+  }
+
+  if (regressions > 0 || missing > 0) {
+    console.log(
+      `\n${regressions} regressions and ${missing} missing benchmarks against ${baselinePath}`
+    )
+    return 1
+  }
+  return 0
+}
+
+process.exit(main())
@@ -2,6 +2,7 @@ import * as child from 'node:child_process'
 import * as fs from 'node:fs'
 import { cwd } from 'node:process'
 import path from 'path/posix'
+import type { StreamStdioBackend, SyncMode } from '@cloudflare/workers-wasi'
 import type { ExecOptions } from './driver/common'
 
 const { OUTPUT_DIR } = process.env
@@ -9,45 +10,173 @@ const moduleNames = fs
   .readdirSync(`${OUTPUT_DIR}/benchmark`)
   .map((dirent) => `benchmark/${dirent}`)
 
+// subjects prefixed with `fs_` exercise the filesystem and are run once per
+// sync mode to compare them, then repeatedly with and without a MemFSPool to
+// measure the throughput of back to back requests
+const syncModes: Array<SyncMode> = ['strict', 'write-back']
+const REQUEST_ITERATIONS = 50
+// subjects like fs_readdir populate large directories first
+const BENCHMARK_TIMEOUT_MS = 5 * 60 * 1000
+
+// stdio subjects take their chunk size as an argument, small chunks are
+// dominated by the per call overhead
+const CHUNK_SIZES = [16, 256, 4096]
+
+// with JSPI the unmodified build of every subject runs with streamStdio as
+// well, to compare it against the .asyncify.wasm build
+const supportsJSPI = typeof (WebAssembly as any).Suspending === 'function'
+
+interface Variant {
+  name?: string
+  args?: string[]
+  fsSyncMode?: SyncMode
+  iterations?: number
+  pooled?: boolean
+  streamStdioBackend?: StreamStdioBackend
+  streamStdioHighWaterMark?: number
+  streamStdioReadahead?: number
+}
+
+const variantsFor = (
+  prettyName: string,
+  streamStdio: boolean
+): Array<Variant> => {
+  if (prettyName.startsWith('fs_')) {
+    return [
+      ...syncModes.map((fsSyncMode) => ({ name: fsSyncMode, fsSyncMode })),
+      { name: 'unpooled', iterations: REQUEST_ITERATIONS },
+      { name: 'pooled', iterations: REQUEST_ITERATIONS, pooled: true },
+    ]
+  }
+  if (prettyName.startsWith('write.')) {
+    // with streamStdio, write-behind buffering against waiting for every write
+    return CHUNK_SIZES.flatMap((size) => [
+      { name: `${size}`, args: [prettyName, `${size}`] },
+      ...(streamStdio
+        ? [
+            {
+              name: `${size}, unbuffered`,
+              args: [prettyName, `${size}`],
+              streamStdioHighWaterMark: 0,
+            },
+          ]
+        : []),
+    ])
+  }
+  if (prettyName.startsWith('read.')) {
+    // with streamStdio, reading ahead against suspending for every chunk
+    return CHUNK_SIZES.flatMap((size) => [
+      { name: `${size}`, args: [prettyName, `${size}`] },
+      ...(streamStdio
+        ? [
+            {
+              name: `${size}, no readahead`,
+              args: [prettyName, `${size}`],
+              streamStdioReadahead: 0,
+            },
+          ]
+        : []),
+    ])
+  }
+  return [{}]
+}
+
+// results of every run by test name, written for benchmark-compare.mjs once
+// all of them finished
+const RESULTS_PATH = `${OUTPUT_DIR}/benchmark-results.json`
+const results: Record<string, unknown> = {}
+
+afterAll(() => {
+  fs.writeFileSync(RESULTS_PATH, JSON.stringify(results, null, 2) + '\n')
+})
+
+const allVariantsFor = (prettyName: string): Array<Variant> => {
+  if (prettyName.endsWith('.asyncify.wasm')) {
+    return variantsFor(prettyName, true).map((variant) => ({
+      ...variant,
+      streamStdioBackend: 'asyncify' as const,
+    }))
+  }
+  return [
+    ...variantsFor(prettyName, false),
+    ...(supportsJSPI
+      ? variantsFor(prettyName, true).map((variant) => ({
+          ...variant,
+          name: variant.name ? `${variant.name}, jspi` : 'jspi',
+          streamStdioBackend: 'jspi' as const,
+        }))
+      : []),
+  ]
+}
+
 for (const modulePath of moduleNames) {
   const prettyName = modulePath.split('/').pop()
   if (!prettyName) throw new Error('unreachable')
 
-  test(`${prettyName}`, async () => {
-    const execOptions: ExecOptions = {
-      moduleName: prettyName,
-      asyncify: prettyName.endsWith('.asyncify.wasm'),
-      fs: {},
-      preopens: [],
-      returnOnExit: false,
-    }
-
-    // Spawns a child process that runs the wasm so we can isolate the profiling to just that
-    // specific test case.
-    const proc = child.execFile(
-      `node`,
-      [
-        '--experimental-vm-modules',
-        '--cpu-prof',
-        '--cpu-prof-dir=./prof',
-        `--cpu-prof-name=${prettyName}.${Date.now()}.cpuprofile`,
-        'standalone.mjs',
-        modulePath,
-        JSON.stringify(execOptions),
-      ],
-      {
-        encoding: 'utf8',
-        cwd: OUTPUT_DIR,
+  const usesFilesystem = prettyName.startsWith('fs_')
+  for (const variant of allVariantsFor(prettyName)) {
+    const { name, args, fsSyncMode, iterations, pooled } = variant
+    const testName = name ? `${prettyName} (${name})` : prettyName
+
+    test(testName, async () => {
+      const execOptions: ExecOptions = {
+        args,
+        moduleName: prettyName,
+        asyncify: variant.streamStdioBackend !== undefined,
+        fs: usesFilesystem ? { '/tmp/.gitkeep': '' } : {},
+        fsSyncMode,
+        iterations,
+        pooled,
+        preopens: usesFilesystem ? ['/tmp'] : [],
+        returnOnExit: false,
+        streamStdioBackend: variant.streamStdioBackend,
+        streamStdioHighWaterMark: variant.streamStdioHighWaterMark,
+        streamStdioReadahead: variant.streamStdioReadahead,
       }
-    )
+      const profileName = name
+        ? `${prettyName}.${name.replace(/\W+/g, '-')}`
+        : prettyName
 
-    let stderr = ''
-    proc.stderr?.on('data', (data) => (stderr += data))
+      // Spawns a child process that runs the wasm so we can isolate the profiling to just that
+      // specific test case.
+      const started = Date.now()
+      const proc = child.execFile(
+        `node`,
+        [
+          '--experimental-vm-modules',
+          '--cpu-prof',
+          '--cpu-prof-dir=./prof',
+          `--cpu-prof-name=${profileName}.${Date.now()}.cpuprofile`,
+          'standalone.mjs',
+          modulePath,
+          JSON.stringify(execOptions),
+        ],
+        {
+          encoding: 'utf8',
+          cwd: OUTPUT_DIR,
+        }
+      )
 
-    const exitCode = await new Promise((resolve) => proc.once('exit', resolve))
+      let stderr = ''
+      proc.stderr?.on('data', (data) => (stderr += data))
 
-    if (exitCode !== 0) {
-      console.error(`Child process exited with code ${exitCode}:\n${stderr}`)
-    }
-  })
+      const exitCode = await new Promise((resolve) => proc.once('exit', resolve))
+
+      if (exitCode !== 0) {
+        console.error(`Child process exited with code ${exitCode}:\n${stderr}`)
+      }
+      expect(exitCode).toBe(0)
+
+      const json = stderr.match(/^results: (.*)$/m)
+      if (json) {
+        results[testName] = JSON.parse(json[1])
+      }
+      const throughput = stderr.match(/^requests\/sec: .*$/m)
+      console.info(
+        `${testName}: ${Date.now() - started}ms${
+          throughput ? `, ${throughput[0]}` : ''
+        }`
+      )
+    }, BENCHMARK_TIMEOUT_MS)
+  }
 }
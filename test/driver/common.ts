@@ -1,26 +1,55 @@
-import { Environment, WASI, _FS } from '@cloudflare/workers-wasi'
+import {
+  Environment,
+  MemFS,
+  StreamStdioBackend,
+  SyncMode,
+  WASI,
+  WASIMetrics,
+  _FS,
+} from '@cloudflare/workers-wasi'
+
+export type FSSource = 'options' | 'lazy' | 'addFile' | 'addFileOverLazy'
 
 export interface ExecOptions {
   args?: string[]
   asyncify: boolean
   env?: Environment
   fs: _FS
+  fsSyncMode?: SyncMode
+  // how `fs` is installed, `'lazy'` serves it through a manifest and an
+  // in-memory loader, `'addFile'` streams it in after construction and
+  // `'addFileOverLazy'` streams it over placeholder manifest entries
+  fsSource?: FSSource
+  // number of times the module is run, and whether the runs share a
+  // MemFSPool, only used by the standalone driver
+  iterations?: number
+  pooled?: boolean
+  metrics?: boolean
   moduleName: string
   preopens: string[]
   returnOnExit: boolean
   stdin?: string
+  stdinSpillThreshold?: number
+  streamStdioBackend?: StreamStdioBackend
+  streamStdioHighWaterMark?: number
+  streamStdioReadahead?: number
 }
 
 export interface ExecResult {
   stdout: string
   stderr: string
   status?: number
+  metrics?: WASIMetrics
 }
 
 export const exec = async (
   options: ExecOptions,
   wasm: WebAssembly.Module,
-  body?: ReadableStream<Uint8Array>
+  body?: ReadableStream<Uint8Array>,
+  memfs?: MemFS,
+  wrapImports: (
+    imports: Record<string, Function>
+  ) => Record<string, Function> = (imports) => imports
 ): Promise<ExecResult> => {
   let TransformStream = global.TransformStream
 
@@ -35,19 +64,58 @@ export const exec = async (
   const stdout = new TransformStream()
   const stderr = new TransformStream()
 
+  const encoder = new TextEncoder()
+  const fsSource = options.fsSource ?? 'options'
+  const lazyFiles =
+    fsSource === 'lazy'
+      ? Object.fromEntries(
+          Object.entries(options.fs).map(([path, contents]) => [
+            path,
+            encoder.encode(contents),
+          ])
+        )
+      : fsSource === 'addFileOverLazy'
+      ? Object.fromEntries(
+          Object.entries(options.fs).map(([path, contents]) => [
+            path,
+            // a different size, stat would give it away if it survived
+            new Uint8Array(contents.length + 1).fill(0x3f),
+          ])
+        )
+      : undefined
+
   const wasi = new WASI({
     args: options.args,
     env: options.env,
-    fs: options.fs,
+    fs: fsSource === 'options' ? options.fs : {},
+    fsManifest:
+      lazyFiles &&
+      Object.fromEntries(
+        Object.entries(lazyFiles).map(([path, data]) => [path, data.byteLength])
+      ),
+    fsLoader: lazyFiles && ((path) => lazyFiles[path]),
+    fsSyncMode: options.fsSyncMode,
+    memfs,
+    metrics: options.metrics,
     preopens: options.preopens,
     returnOnExit: options.returnOnExit,
     stderr: stderr.writable,
     stdin: body,
+    stdinSpillThreshold: options.stdinSpillThreshold,
     stdout: stdout.writable,
     streamStdio: options.asyncify,
+    streamStdioBackend: options.streamStdioBackend,
+    streamStdioHighWaterMark: options.streamStdioHighWaterMark,
+    streamStdioReadahead: options.streamStdioReadahead,
   })
+  if (fsSource === 'addFile' || fsSource === 'addFileOverLazy') {
+    for (const [path, contents] of Object.entries(options.fs)) {
+      await wasi.addFile(path, toStream(encoder.encode(contents)))
+    }
+  }
+
   const instance = new WebAssembly.Instance(wasm, {
-    wasi_snapshot_preview1: wasi.wasiImport,
+    wasi_snapshot_preview1: wrapImports(wasi.wasiImport),
   })
   const promise = wasi.start(instance)
 
@@ -61,6 +129,7 @@ export const exec = async (
       stdout: streams[0],
       stderr: streams[1],
       status: await promise,
+      metrics: wasi.metrics,
     }
     return result
   } catch (e: any) {
@@ -69,6 +138,21 @@ export const exec = async (
   }
 }
 
+// splits `data` into small chunks to exercise chunked ingestion
+const toStream = (data: Uint8Array): ReadableStream<Uint8Array> => {
+  let offset = 0
+  return new ReadableStream({
+    pull: (controller) => {
+      if (offset >= data.byteLength) {
+        controller.close()
+      } else {
+        controller.enqueue(data.subarray(offset, offset + 7))
+        offset += 7
+      }
+    },
+  })
+}
+
 const collectStream = async (stream: ReadableStream): Promise<string> => {
   const chunks: Uint8Array[] = []
 
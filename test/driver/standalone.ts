@@ -1,27 +1,138 @@
 import * as fs from 'node:fs/promises'
 import { ReadableStream } from 'node:stream/web'
-import { exec } from './common'
+import { MemFS, MemFSPool } from '@cloudflare/workers-wasi'
+import type { MemFSStats } from '@cloudflare/workers-wasi'
+import { exec, ExecResult } from './common'
 
 const [modulePath, rawOptions] = process.argv.slice(2)
 const options = JSON.parse(rawOptions)
 
 const nulls = new Uint8Array(4096).fill(0)
-let written = 0
-
-const stdinStream = new ReadableStream<Uint8Array>({
-  pull: (controller) => {
-    if (written > 1_000_000) {
-      controller.close()
-    } else {
-      controller.enqueue(nulls)
-      written += nulls.byteLength
+
+const stdinStream = () => {
+  let written = 0
+  return new ReadableStream<Uint8Array>({
+    pull: (controller) => {
+      if (written > 1_000_000) {
+        controller.close()
+      } else {
+        controller.enqueue(nulls)
+        written += nulls.byteLength
+      }
+    },
+  })
+}
+
+const pool = options.pooled
+  ? new MemFSPool({
+      preopens: options.preopens,
+      fs: options.fs,
+      syncMode: options.fsSyncMode,
+    })
+  : undefined
+
+// latency of every call by import name, in milliseconds
+const latencies: Record<string, Array<number>> = {}
+
+const timeImports = (imports: Record<string, Function>) => {
+  for (const [name, f] of Object.entries(imports)) {
+    // JSPI wrappers can't be called from JavaScript, those calls aren't timed
+    if (typeof f !== 'function') continue
+
+    const samples = (latencies[name] ??= [])
+    imports[name] = (...args: any[]) => {
+      const started = performance.now()
+      try {
+        return f(...args)
+      } finally {
+        samples.push(performance.now() - started)
+      }
     }
-  },
-})
+  }
+  return imports
+}
+
+// `p` of the sorted `samples` in microseconds
+const percentile = (samples: Array<number>, p: number): number => {
+  if (samples.length === 0) return 0
+  const index = Math.min(samples.length - 1, Math.floor(samples.length * p))
+  return Math.round(samples[index] * 1000 * 100) / 100
+}
+
+const summarize = (samples: Array<number>) => {
+  samples.sort((a, b) => a - b)
+  return {
+    calls: samples.length,
+    p50Us: percentile(samples, 0.5),
+    p99Us: percentile(samples, 0.99),
+  }
+}
+
+const run = async (wasmModule: WebAssembly.Module) => {
+  const iterations = options.iterations ?? 1
+  const started = performance.now()
+
+  let result: ExecResult | undefined
+  let peakMemoryBytes = 0
+  // block device counters of the last run, pooled filesystems keep counting
+  // across resets
+  let fsStats: MemFSStats | undefined
+  // where the time of all runs went, from WASI's metrics
+  const timeMs = {
+    totalMs: 0,
+    guestMs: 0,
+    trampolineMs: 0,
+    memfsMs: 0,
+    waitMs: 0,
+  }
+  for (let i = 0; i < iterations; ++i) {
+    // the filesystem is created here rather than by WASI to measure it
+    const memfs =
+      pool?.acquire() ??
+      new MemFS(options.preopens, options.fs, { syncMode: options.fsSyncMode })
+    result = await exec(
+      { ...options, metrics: true },
+      wasmModule,
+      stdinStream() as any,
+      memfs,
+      timeImports
+    )
+    peakMemoryBytes = Math.max(peakMemoryBytes, memfs.memorySize)
+    fsStats = memfs.stats()
+    for (const key of Object.keys(timeMs) as Array<keyof typeof timeMs>) {
+      timeMs[key] += result.metrics![key]
+    }
+    pool?.release(memfs)
+  }
+
+  const seconds = (performance.now() - started) / 1000
+  if (iterations > 1) {
+    console.error(`requests/sec: ${(iterations / seconds).toFixed(1)}`)
+  }
+
+  const all = Object.values(latencies).flat()
+  const { p50Us, p99Us } = summarize(all)
+  const results = {
+    ops: all.length,
+    opsPerSec: Math.round(all.length / seconds),
+    p50Us,
+    p99Us,
+    peakMemoryBytes,
+    timeMs,
+    fsStats,
+    imports: Object.fromEntries(
+      Object.entries(latencies)
+        .filter(([, samples]) => samples.length > 0)
+        .map(([name, samples]) => [name, summarize(samples)])
+    ),
+  }
+  console.error(`results: ${JSON.stringify(results)}`)
+  return result!
+}
 
 fs.readFile(modulePath)
   .then((wasmBytes) => new WebAssembly.Module(wasmBytes))
-  .then((wasmModule) => exec(options, wasmModule, stdinStream as any))
+  .then(run)
   .then((result) => {
     console.log(result.stdout)
     console.error(result.stderr)
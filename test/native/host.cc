@@ -0,0 +1,71 @@
+// The "internal" imports of memfs.wasm for the native build. Host and memfs
+// memory are the same address space, so addresses are plain pointers and
+// copies between them are a memcpy.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "util.h"
+
+namespace {
+void* from_addr(const int32_t addr) { return reinterpret_cast<void*>(addr); }
+
+// layout of CopyBatch::Region
+struct Region {
+  int32_t src_addr;
+  int32_t dst_addr;
+  int32_t size;
+};
+
+void copy_regions(const int32_t regions_addr, const int32_t count) {
+  const auto* regions = static_cast<const Region*>(from_addr(regions_addr));
+  for (int32_t i = 0; i < count; ++i) {
+    memcpy(from_addr(regions[i].dst_addr), from_addr(regions[i].src_addr),
+           regions[i].size);
+  }
+}
+}  // namespace
+
+int32_t copy_out(int32_t src_addr, int32_t dst_addr, int32_t size) {
+  memcpy(from_addr(dst_addr), from_addr(src_addr), size);
+  return 0;
+}
+
+int32_t copy_in(int32_t src_addr, int32_t dst_addr, int32_t size) {
+  memcpy(from_addr(dst_addr), from_addr(src_addr), size);
+  return 0;
+}
+
+int32_t copy_out_batch(int32_t regions_addr, int32_t count) {
+  copy_regions(regions_addr, count);
+  return 0;
+}
+
+int32_t copy_in_batch(int32_t regions_addr, int32_t count) {
+  copy_regions(regions_addr, count);
+  return 0;
+}
+
+// there is no base image and no lazily loaded files
+int32_t base_read(int32_t, int32_t, int32_t, int32_t) { return 0; }
+
+int32_t lazy_load(int32_t, int32_t, int32_t, int32_t, int32_t) { return -1; }
+
+int32_t trace(int32_t is_error, int32_t addr, int32_t size) {
+  fprintf(stderr, "%.*s\n", static_cast<int>(size),
+          static_cast<const char*>(from_addr(addr)));
+  if (is_error) {
+    // a failed REQUIRE, stop where a debugger or sanitizer can see it
+    abort();
+  }
+  return 0;
+}
+
+int32_t now_ms() {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<int32_t>(int64_t{now.tv_sec} * 1000 +
+                              now.tv_nsec / 1000000);
+}
@@ -0,0 +1,9 @@
+#pragma once
+// The sysroot's wasi/api.h refuses anything but wasm32-wasi. The native
+// build is i386 with -malign-double, which has the data layout the header
+// asserts, so it is included as if this was wasm32.
+#define __wasi__ 1
+#define __wasm32__ 1
+#include_next <wasi/api.h>
+#undef __wasm32__
+#undef __wasi__
@@ -0,0 +1,404 @@
+// Microbenchmarks of the memfs exports in a native build, see `make
+// native-bench`. Without the wasm engine and JavaScript in between the
+// filesystem can be run under perf, sanitizers and cache-miss counters.
+//
+//   build/native/memfs_bench [filter] [scale]
+//
+// runs every benchmark whose name contains `filter`, `scale` multiplies the
+// iterations. Each benchmark calls a single export in its timed loop, the
+// descriptors and paths it needs are prepared beforehand.
+#include <wasi/api.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "memfs_exports.h"
+
+namespace {
+int32_t addr(const void* ptr) { return reinterpret_cast<int32_t>(ptr); }
+
+void check(const int32_t rc, const char* expr) {
+  if (rc != __WASI_ERRNO_SUCCESS) {
+    fprintf(stderr, "%s failed: %d\n", expr, rc);
+    abort();
+  }
+}
+
+#define CHECK(x) check((x), #x)
+
+constexpr __wasi_fd_t kPreopen = 3;
+constexpr __wasi_rights_t kAllRights = ~__wasi_rights_t{};
+constexpr std::size_t kFileSize = 1024 * 1024;
+constexpr std::size_t kChunkSize = 4096;
+
+__wasi_fd_t open_path(const std::string& path,
+                      const __wasi_oflags_t oflags = __WASI_OFLAGS_CREAT,
+                      const __wasi_fdflags_t fdflags = 0) {
+  __wasi_fd_t fd;
+  CHECK(path_open(kPreopen, 0, addr(path.data()), path.size(), oflags,
+                  kAllRights, kAllRights, fdflags, addr(&fd)));
+  return fd;
+}
+
+void create_directory(const std::string& path) {
+  CHECK(path_create_directory(kPreopen, addr(path.data()), path.size()));
+}
+
+void remove_directory(const std::string& path) {
+  CHECK(path_remove_directory(kPreopen, addr(path.data()), path.size()));
+}
+
+void unlink_file(const std::string& path) {
+  CHECK(path_unlink_file(kPreopen, addr(path.data()), path.size()));
+}
+
+void close_fd(const __wasi_fd_t fd) { CHECK(fd_close(fd)); }
+
+void write_fd(const __wasi_fd_t fd, const void* data, const std::size_t size) {
+  const __wasi_ciovec_t iov = {static_cast<const uint8_t*>(data), size};
+  __wasi_size_t written;
+  CHECK(fd_write(fd, addr(&iov), 1, addr(&written)));
+}
+
+// state shared by the setup, run and teardown of the current benchmark
+struct Fixture {
+  __wasi_fd_t fd = 0;
+  std::vector<__wasi_fd_t> fds;
+  std::vector<std::string> paths;
+  std::vector<uint8_t> buffer = std::vector<uint8_t>(kChunkSize, 'x');
+  __wasi_iovec_t iov = {buffer.data(), buffer.size()};
+  __wasi_size_t size = 0;
+  __wasi_filesize_t filesize = 0;
+  __wasi_fdstat_t fdstat = {};
+  __wasi_filestat_t filestat = {};
+  __wasi_prestat_t prestat = {};
+};
+
+Fixture fixture;
+
+std::vector<std::string> numbered(const char* prefix, const int count) {
+  std::vector<std::string> paths;
+  for (int i = 0; i < count; ++i) {
+    paths.push_back(prefix + std::to_string(i));
+  }
+  return paths;
+}
+
+// a file of kFileSize bytes opened as fixture.fd
+void open_large_file(const int) {
+  fixture.fd = open_path("large", __WASI_OFLAGS_CREAT | __WASI_OFLAGS_TRUNC);
+  for (std::size_t i = 0; i < kFileSize / kChunkSize; ++i) {
+    write_fd(fixture.fd, fixture.buffer.data(), kChunkSize);
+  }
+}
+
+void open_small_file(const int) { fixture.fd = open_path("small"); }
+
+void close_file(const int) { close_fd(fixture.fd); }
+
+void close_fds(const int) {
+  for (const auto fd : fixture.fds) {
+    close_fd(fd);
+  }
+  fixture.fds.clear();
+}
+
+void open_fds(const int count) {
+  for (int i = 0; i < count; ++i) {
+    fixture.fds.push_back(open_path("small"));
+  }
+}
+
+void unlink_paths(const int) {
+  for (const auto& path : fixture.paths) {
+    unlink_file(path);
+  }
+}
+
+void remove_directories(const int) {
+  for (const auto& path : fixture.paths) {
+    remove_directory(path);
+  }
+}
+
+struct Benchmark {
+  const char* name;
+  int iterations;
+  std::function<void(int iterations)> setup;
+  // returns the errno of the call, reported if it isn't success
+  std::function<int32_t(int iteration)> run;
+  std::function<void(int iterations)> teardown;
+};
+
+const std::vector<Benchmark> benchmarks = {
+    {"fd_advise", 1000000, open_small_file,
+     [](int) {
+       return fd_advise(fixture.fd, 0, kChunkSize, __WASI_ADVICE_NORMAL);
+     },
+     close_file},
+    {"fd_allocate", 100000, open_small_file,
+     [](int i) { return fd_allocate(fixture.fd, 0, (i % 64 + 1) * 64); },
+     close_file},
+    {"fd_close", 10000, open_fds,
+     [](int i) { return fd_close(fixture.fds[i]); },
+     [](int) { fixture.fds.clear(); }},
+    {"fd_datasync", 100000, open_small_file,
+     [](int) { return fd_datasync(fixture.fd); }, close_file},
+    {"fd_fdstat_get", 1000000, open_small_file,
+     [](int) { return fd_fdstat_get(fixture.fd, addr(&fixture.fdstat)); },
+     close_file},
+    {"fd_fdstat_set_flags", 1000000, open_small_file,
+     [](int i) {
+       const __wasi_fdflags_t flags = i % 2 ? __WASI_FDFLAGS_APPEND : 0;
+       return fd_fdstat_set_flags(fixture.fd, flags);
+     },
+     close_file},
+    {"fd_fdstat_set_rights", 1000000, open_small_file,
+     [](int) {
+       return fd_fdstat_set_rights(fixture.fd, kAllRights, kAllRights);
+     },
+     close_file},
+    {"fd_filestat_get", 1000000, open_small_file,
+     [](int) { return fd_filestat_get(fixture.fd, addr(&fixture.filestat)); },
+     close_file},
+    {"fd_filestat_set_size", 100000, open_small_file,
+     [](int i) {
+       return fd_filestat_set_size(fixture.fd, (i % 2) * kChunkSize);
+     },
+     close_file},
+    {"fd_filestat_set_times", 100000, open_small_file,
+     [](int i) {
+       return fd_filestat_set_times(
+           fixture.fd, i, i, __WASI_FSTFLAGS_ATIM | __WASI_FSTFLAGS_MTIM);
+     },
+     close_file},
+    {"fd_pread", 100000, open_large_file,
+     [](int i) {
+       // a stride that visits every chunk of the file out of order
+       const auto offset = (i * 37 % (kFileSize / kChunkSize)) * kChunkSize;
+       return fd_pread(fixture.fd, addr(&fixture.iov), 1, offset,
+                       addr(&fixture.size));
+     },
+     close_file},
+    {"fd_prestat_get", 1000000, nullptr,
+     [](int) { return fd_prestat_get(kPreopen, addr(&fixture.prestat)); },
+     nullptr},
+    {"fd_prestat_dir_name", 1000000, nullptr,
+     [](int) {
+       return fd_prestat_dir_name(kPreopen, addr(fixture.buffer.data()), 4);
+     },
+     nullptr},
+    {"fd_pwrite", 100000, open_large_file,
+     [](int i) {
+       const auto offset = (i * 37 % (kFileSize / kChunkSize)) * kChunkSize;
+       return fd_pwrite(fixture.fd, addr(&fixture.iov), 1, offset,
+                        addr(&fixture.size));
+     },
+     close_file},
+    {"fd_read", 100000, open_large_file,
+     [](int i) {
+       if (i % (kFileSize / kChunkSize) == 0) {
+         CHECK(fd_seek(fixture.fd, 0, __WASI_WHENCE_SET,
+                       addr(&fixture.filesize)));
+       }
+       return fd_read(fixture.fd, addr(&fixture.iov), 1, addr(&fixture.size));
+     },
+     close_file},
+    {"fd_readdir", 10000,
+     [](int) {
+       create_directory("readdir");
+       fixture.paths = numbered("readdir/", 100);
+       for (const auto& path : fixture.paths) {
+         close_fd(open_path(path));
+       }
+       fixture.fd = open_path("readdir", __WASI_OFLAGS_DIRECTORY);
+     },
+     [](int) {
+       return fd_readdir(fixture.fd, addr(fixture.buffer.data()),
+                         fixture.buffer.size(), __WASI_DIRCOOKIE_START,
+                         addr(&fixture.size));
+     },
+     [](int iterations) {
+       close_file(iterations);
+       unlink_paths(iterations);
+       remove_directory("readdir");
+     }},
+    {"fd_renumber", 10000,
+     [](int iterations) { open_fds(2 * iterations); },
+     [](int i) {
+       return fd_renumber(fixture.fds[2 * i], fixture.fds[2 * i + 1]);
+     },
+     [](int iterations) {
+       for (int i = 0; i < iterations; ++i) {
+         close_fd(fixture.fds[2 * i + 1]);
+       }
+       fixture.fds.clear();
+     }},
+    {"fd_seek", 1000000, open_large_file,
+     [](int i) {
+       return fd_seek(fixture.fd, i % kFileSize, __WASI_WHENCE_SET,
+                      addr(&fixture.filesize));
+     },
+     close_file},
+    {"fd_sync", 100000, open_small_file,
+     [](int) { return fd_sync(fixture.fd); }, close_file},
+    {"fd_tell", 1000000, open_large_file,
+     [](int) { return fd_tell(fixture.fd, addr(&fixture.filesize)); },
+     close_file},
+    {"fd_write", 100000,
+     [](int) {
+       fixture.fd =
+           open_path("append", __WASI_OFLAGS_CREAT | __WASI_OFLAGS_TRUNC);
+     },
+     [](int) {
+       const __wasi_ciovec_t iov = {fixture.buffer.data(), 64};
+       return fd_write(fixture.fd, addr(&iov), 1, addr(&fixture.size));
+     },
+     [](int iterations) {
+       close_file(iterations);
+       unlink_file("append");
+     }},
+    {"path_create_directory", 10000,
+     [](int iterations) { fixture.paths = numbered("mkdir", iterations); },
+     [](int i) {
+       const auto& path = fixture.paths[i];
+       return path_create_directory(kPreopen, addr(path.data()), path.size());
+     },
+     remove_directories},
+    {"path_filestat_get", 100000,
+     [](int) {
+       std::string path;
+       for (int depth = 0; depth < 8; ++depth) {
+         path += "deep/";
+         create_directory(path);
+       }
+       path += "file";
+       close_fd(open_path(path));
+       fixture.paths = {path};
+     },
+     [](int) {
+       const auto& path = fixture.paths[0];
+       return path_filestat_get(kPreopen, 0, addr(path.data()), path.size(),
+                                addr(&fixture.filestat));
+     },
+     nullptr},
+    {"path_filestat_set_times", 100000,
+     [](int) { close_fd(open_path("small")); },
+     [](int i) {
+       return path_filestat_set_times(
+           kPreopen, 0, addr("small"), 5, i, i,
+           __WASI_FSTFLAGS_ATIM | __WASI_FSTFLAGS_MTIM);
+     },
+     nullptr},
+    {"path_link", 100000, nullptr,
+     [](int) {
+       return path_link(kPreopen, 0, addr("small"), 5, kPreopen, addr("link"),
+                        4);
+     },
+     nullptr},
+    {"path_open", 10000, [](int) { close_fd(open_path("small")); },
+     [](int) {
+       __wasi_fd_t fd;
+       const auto rc = path_open(kPreopen, 0, addr("small"), 5, 0, kAllRights,
+                                 kAllRights, 0, addr(&fd));
+       fixture.fds.push_back(fd);
+       return rc;
+     },
+     close_fds},
+    {"path_readlink", 100000, nullptr,
+     [](int) {
+       return path_readlink(kPreopen, addr("small"), 5,
+                            addr(fixture.buffer.data()), fixture.buffer.size(),
+                            addr(&fixture.size));
+     },
+     nullptr},
+    {"path_remove_directory", 10000,
+     [](int iterations) {
+       fixture.paths = numbered("rmdir", iterations);
+       for (const auto& path : fixture.paths) {
+         create_directory(path);
+       }
+     },
+     [](int i) {
+       const auto& path = fixture.paths[i];
+       return path_remove_directory(kPreopen, addr(path.data()), path.size());
+     },
+     nullptr},
+    {"path_rename", 10000, [](int) { close_fd(open_path("rename-a")); },
+     [](int i) {
+       const char* from = i % 2 ? "rename-b" : "rename-a";
+       const char* to = i % 2 ? "rename-a" : "rename-b";
+       return path_rename(kPreopen, addr(from), 8, kPreopen, addr(to), 8);
+     },
+     [](int iterations) {
+       unlink_file(iterations % 2 ? "rename-b" : "rename-a");
+     }},
+    {"path_symlink", 100000, nullptr,
+     [](int) {
+       return path_symlink(addr("small"), 5, kPreopen, addr("symlink"), 7);
+     },
+     nullptr},
+    {"path_unlink_file", 10000,
+     [](int iterations) {
+       fixture.paths = numbered("unlink", iterations);
+       for (const auto& path : fixture.paths) {
+         close_fd(open_path(path));
+       }
+     },
+     [](int i) {
+       const auto& path = fixture.paths[i];
+       return path_unlink_file(kPreopen, addr(path.data()), path.size());
+     },
+     nullptr},
+};
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* filter = argc > 1 ? argv[1] : "";
+  const double scale = argc > 2 ? atof(argv[2]) : 1;
+
+  CHECK(memfs_main());
+  const std::string config = R"({"preopens": ["/tmp"], "fs": {}})";
+  CHECK(initialize_internal(addr(config.data()), config.size()));
+
+  for (const auto& benchmark : benchmarks) {
+    if (!strstr(benchmark.name, filter)) {
+      continue;
+    }
+
+    const auto iterations =
+        std::max(1, static_cast<int>(benchmark.iterations * scale));
+    fixture.fds.clear();
+    fixture.paths.clear();
+    if (benchmark.setup) {
+      benchmark.setup(iterations);
+    }
+
+    int32_t rc = __WASI_ERRNO_SUCCESS;
+    const auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      rc = benchmark.run(i);
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - started;
+
+    if (benchmark.teardown) {
+      benchmark.teardown(iterations);
+    }
+
+    printf("%-24s %10d %12.1f ns/op", benchmark.name, iterations,
+           elapsed.count() / iterations);
+    if (rc != __WASI_ERRNO_SUCCESS) {
+      printf("  (errno %d)", rc);
+    }
+    printf("\n");
+  }
+  return 0;
+}
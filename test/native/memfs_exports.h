@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+
+// Exports of src/memfs.cc, which only declares them by defining them. main()
+// is renamed to memfs_main() in the native build, it formats and mounts the
+// filesystem.
+int memfs_main();
+int32_t initialize_internal(int32_t arg0, int32_t arg1);
+
+int32_t fd_advise(int32_t arg0, int64_t arg1, int64_t arg2, int32_t arg3);
+int32_t fd_allocate(int32_t arg0, int64_t arg1, int64_t arg2);
+int32_t fd_close(int32_t arg0);
+int32_t fd_datasync(int32_t arg0);
+int32_t fd_fdstat_get(int32_t arg0, int32_t arg1);
+int32_t fd_fdstat_set_flags(int32_t arg0, int32_t arg1);
+int32_t fd_fdstat_set_rights(int32_t arg0, int64_t arg1, int64_t arg2);
+int32_t fd_filestat_get(int32_t arg0, int32_t arg1);
+int32_t fd_filestat_set_size(int32_t arg0, int64_t arg1);
+int32_t fd_filestat_set_times(int32_t arg0, int64_t arg1, int64_t arg2,
+                              int32_t arg3);
+int32_t fd_pread(int32_t arg0, int32_t arg1, int32_t arg2, int64_t arg3,
+                 int32_t arg4);
+int32_t fd_prestat_get(int32_t arg0, int32_t arg1);
+int32_t fd_prestat_dir_name(int32_t arg0, int32_t arg1, int32_t arg2);
+int32_t fd_pwrite(int32_t arg0, int32_t arg1, int32_t arg2, int64_t arg3,
+                  int32_t arg4);
+int32_t fd_read(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3);
+int32_t fd_readdir(int32_t arg0, int32_t arg1, int32_t arg2, int64_t arg3,
+                   int32_t arg4);
+int32_t fd_renumber(int32_t arg0, int32_t arg1);
+int32_t fd_seek(int32_t arg0, int64_t arg1, int32_t arg2, int32_t arg3);
+int32_t fd_sync(int32_t arg0);
+int32_t fd_tell(int32_t arg0, int32_t arg1);
+int32_t fd_write(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3);
+int32_t path_create_directory(int32_t arg0, int32_t arg1, int32_t arg2);
+int32_t path_filestat_get(int32_t arg0, int32_t arg1, int32_t arg2,
+                          int32_t arg3, int32_t arg4);
+int32_t path_filestat_set_times(int32_t arg0, int32_t arg1, int32_t arg2,
+                                int32_t arg3, int64_t arg4, int64_t arg5,
+                                int32_t arg6);
+int32_t path_link(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3,
+                  int32_t arg4, int32_t arg5, int32_t arg6);
+int32_t path_open(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3,
+                  int32_t arg4, int64_t arg5, int64_t arg6, int32_t arg7,
+                  int32_t arg8);
+int32_t path_readlink(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3,
+                      int32_t arg4, int32_t arg5);
+int32_t path_remove_directory(int32_t arg0, int32_t arg1, int32_t arg2);
+int32_t path_rename(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3,
+                    int32_t arg4, int32_t arg5);
+int32_t path_symlink(int32_t arg0, int32_t arg1, int32_t arg2, int32_t arg3,
+                     int32_t arg4);
+int32_t path_unlink_file(int32_t arg0, int32_t arg1, int32_t arg2);
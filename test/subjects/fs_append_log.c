@@ -0,0 +1,36 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdio.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+#define LINES 16384
+#define LINES_PER_FILE 4096
+
+// appends log lines of varying length, one write each, and rotates the
+// log like a logger would
+int main() {
+  char line[128];
+
+  int fd = -1;
+  for (int i = 0; i < LINES; i++) {
+    if (i % LINES_PER_FILE == 0) {
+      if (fd >= 0) {
+        assert(close(fd) == 0);
+        assert(rename("/tmp/append.log", "/tmp/append.log.1") == 0);
+      }
+      fd = open("/tmp/append.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+      assert(fd >= 0);
+    }
+
+    const int length = snprintf(line, sizeof(line),
+                                "request %d handled in %d ms, status %d\n", i,
+                                i % 97, i % 7 ? 200 : 503);
+    assert(write(fd, line, length) == length);
+  }
+  assert(close(fd) == 0);
+
+  struct stat st;
+  assert(stat("/tmp/append.log.1", &st) == 0);
+  assert(st.st_size > 0);
+}
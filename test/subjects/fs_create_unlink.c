@@ -0,0 +1,28 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdio.h"
+#include "unistd.h"
+
+#define BATCH 64
+#define ITERATIONS 64
+
+// creates a batch of small files and removes them again, the working set
+// stays small while littlefs keeps allocating and releasing blocks
+int main() {
+  const char contents[] = "small file\n";
+  char path[64];
+
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    for (int i = 0; i < BATCH; i++) {
+      snprintf(path, sizeof(path), "/tmp/create_unlink_%02d", i);
+      int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      assert(fd >= 0);
+      assert(write(fd, contents, sizeof(contents)) == sizeof(contents));
+      assert(close(fd) == 0);
+    }
+    for (int i = 0; i < BATCH; i++) {
+      snprintf(path, sizeof(path), "/tmp/create_unlink_%02d", i);
+      assert(unlink(path) == 0);
+    }
+  }
+}
@@ -0,0 +1,39 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "string.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+#define DEPTH 16
+#define ITERATIONS 8192
+
+// stats every level of a deep tree, each lookup resolves all of the
+// components above it
+int main() {
+  char path[DEPTH * 4 + 16] = "/tmp";
+  size_t lengths[DEPTH];
+
+  for (int depth = 0; depth < DEPTH; depth++) {
+    strcat(path, "/dir");
+    lengths[depth] = strlen(path);
+    assert(mkdir(path, 0755) == 0);
+  }
+  strcat(path, "/leaf");
+  int fd = open(path, O_WRONLY | O_CREAT, 0644);
+  assert(fd >= 0);
+  assert(close(fd) == 0);
+
+  struct stat st;
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    assert(stat(path, &st) == 0);
+    assert(S_ISREG(st.st_mode));
+
+    // the same prefix, but a different depth every time
+    char prefix[sizeof(path)];
+    const size_t length = lengths[iterations % DEPTH];
+    memcpy(prefix, path, length);
+    prefix[length] = '\0';
+    assert(stat(prefix, &st) == 0);
+    assert(S_ISDIR(st.st_mode));
+  }
+}
@@ -0,0 +1,44 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdio.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+#define DIRS 32
+#define FILES_PER_DIR 4
+#define ITERATIONS 32
+
+// creates, populates, renames and removes directories, the parent's
+// metadata is rewritten by every step
+int main() {
+  char dir[64];
+  char renamed[64];
+  char path[96];
+
+  assert(mkdir("/tmp/churn", 0755) == 0);
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    for (int i = 0; i < DIRS; i++) {
+      snprintf(dir, sizeof(dir), "/tmp/churn/d%02d", i);
+      assert(mkdir(dir, 0755) == 0);
+      for (int j = 0; j < FILES_PER_DIR; j++) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, j);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        assert(fd >= 0);
+        assert(close(fd) == 0);
+      }
+
+      snprintf(renamed, sizeof(renamed), "/tmp/churn/r%02d", i);
+      assert(rename(dir, renamed) == 0);
+    }
+
+    for (int i = 0; i < DIRS; i++) {
+      snprintf(renamed, sizeof(renamed), "/tmp/churn/r%02d", i);
+      for (int j = 0; j < FILES_PER_DIR; j++) {
+        snprintf(path, sizeof(path), "%s/f%d", renamed, j);
+        assert(unlink(path) == 0);
+      }
+      assert(rmdir(renamed) == 0);
+    }
+  }
+  assert(rmdir("/tmp/churn") == 0);
+}
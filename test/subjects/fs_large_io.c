@@ -0,0 +1,36 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/uio.h"
+#include "unistd.h"
+
+#define SIZE (8 * 1024 * 1024)
+
+int main() {
+  char* data = malloc(SIZE);
+  char* copy = malloc(SIZE);
+  assert(data && copy);
+  for (int i = 0; i < SIZE; i++) {
+    data[i] = (char)(i * 31);
+  }
+
+  // each transfer is a single syscall
+  int fd = open("/tmp/large_io.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  assert(write(fd, data, SIZE) == SIZE);
+  assert(lseek(fd, 0, SEEK_SET) == 0);
+  assert(read(fd, copy, SIZE) == SIZE);
+  assert(memcmp(data, copy, SIZE) == 0);
+
+  // zero-length transfers and empty iovecs don't take up a window
+  assert(write(fd, data, 0) == 0);
+  assert(read(fd, copy, 0) == 0);
+  struct iovec iovs[] = {{copy, SIZE}, {copy, 0}};
+  assert(lseek(fd, 0, SEEK_SET) == 0);
+  assert(readv(fd, iovs, 2) == SIZE);
+  assert(close(fd) == 0);
+
+  free(copy);
+  free(data);
+}
@@ -0,0 +1,31 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdio.h"
+#include "unistd.h"
+
+#define FILES 64
+#define ITERATIONS 8192
+
+int main() {
+  char path[64];
+
+  for (int i = 0; i < FILES; i++) {
+    snprintf(path, sizeof(path), "/tmp/open_close_%02d", i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0);
+    assert(close(fd) == 0);
+  }
+
+  // numbers are reused, the lowest free one is handed out first
+  int first = -1;
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    snprintf(path, sizeof(path), "/tmp/open_close_%02d", iterations % FILES);
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    if (first < 0) {
+      first = fd;
+    }
+    assert(fd == first);
+    assert(close(fd) == 0);
+  }
+}
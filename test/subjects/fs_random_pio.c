@@ -0,0 +1,43 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdint.h"
+#include "string.h"
+#include "unistd.h"
+
+// page sized positional I/O at random offsets, like a database would do
+#define PAGE_SIZE 4096
+#define PAGES 1024
+#define ITERATIONS 8192
+
+static uint32_t next_random(uint32_t* state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+int main() {
+  char page[PAGE_SIZE];
+  uint32_t state = 1;
+
+  int fd = open("/tmp/random_pio.db", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+
+  memset(page, 0, sizeof(page));
+  for (int i = 0; i < PAGES; i++) {
+    assert(write(fd, page, PAGE_SIZE) == PAGE_SIZE);
+  }
+  assert(lseek(fd, 0, SEEK_CUR) == (off_t)PAGES * PAGE_SIZE);
+
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    const off_t offset = (off_t)(next_random(&state) % PAGES) * PAGE_SIZE;
+    if (next_random(&state) % 4 == 0) {
+      memset(page, iterations, sizeof(page));
+      assert(pwrite(fd, page, PAGE_SIZE, offset) == PAGE_SIZE);
+    } else {
+      assert(pread(fd, page, PAGE_SIZE, offset) == PAGE_SIZE);
+    }
+  }
+
+  // positional I/O doesn't move the file position
+  assert(lseek(fd, 0, SEEK_CUR) == (off_t)PAGES * PAGE_SIZE);
+  assert(close(fd) == 0);
+}
@@ -0,0 +1,63 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+#include "sys/stat.h"
+#include "unistd.h"
+#include "wasi/api.h"
+
+#define ENTRIES 10000
+#define BUFFER_SIZE 256
+
+int main() {
+  char path[64];
+
+  assert(mkdir("/tmp/readdir", 0755) == 0);
+  for (int i = 0; i < ENTRIES; i++) {
+    snprintf(path, sizeof(path), "/tmp/readdir/%05d", i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0);
+    assert(close(fd) == 0);
+  }
+
+  int dir = open("/tmp/readdir", O_RDONLY | O_DIRECTORY);
+  assert(dir >= 0);
+
+  // calls fd_readdir directly, libc would use a larger buffer
+  uint8_t buf[BUFFER_SIZE];
+  __wasi_dircookie_t cookie = __WASI_DIRCOOKIE_START;
+  int entries = 0;
+  for (;;) {
+    __wasi_size_t used = 0;
+    assert(__wasi_fd_readdir(dir, buf, sizeof(buf), cookie, &used) == 0);
+
+    size_t offset = 0;
+    while (offset + sizeof(__wasi_dirent_t) <= used) {
+      __wasi_dirent_t dirent;
+      memcpy(&dirent, buf + offset, sizeof(dirent));
+      offset += sizeof(dirent);
+      if (offset + dirent.d_namlen > used) {
+        // truncated, requested again from its cookie
+        break;
+      }
+      offset += dirent.d_namlen;
+      cookie = dirent.d_next;
+      entries++;
+    }
+
+    if (used < sizeof(buf)) {
+      break;
+    }
+  }
+
+  // including "." and ".."
+  assert(entries == ENTRIES + 2);
+  assert(close(dir) == 0);
+
+  // the preopen of /tmp is listed without being opened first
+  __wasi_size_t used = 0;
+  assert(__wasi_fd_readdir(3, buf, sizeof(buf), __WASI_DIRCOOKIE_START,
+                           &used) == 0);
+  assert(used > 0);
+}
@@ -0,0 +1,31 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "string.h"
+#include "unistd.h"
+
+// two descriptors writing to the same file, with the write-back sync mode the
+// pending write of one must be committed before the other writes
+#define ITERATIONS 1024
+
+int main() {
+  char buf[8];
+
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    int a = open("/tmp/shared.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(a >= 0);
+    int b = open("/tmp/shared.txt", O_RDWR);
+    assert(b >= 0);
+
+    assert(write(a, "aaaa", 4) == 4);
+    assert(pwrite(b, "bb", 2, 2) == 2);
+    assert(ftruncate(b, 6) == 0);
+    assert(close(a) == 0);
+    assert(close(b) == 0);
+
+    int fd = open("/tmp/shared.txt", O_RDONLY);
+    assert(fd >= 0);
+    assert(read(fd, buf, sizeof(buf)) == 6);
+    assert(memcmp(buf, "aabb\0\0", 6) == 0);
+    assert(close(fd) == 0);
+  }
+}
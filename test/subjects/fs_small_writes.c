@@ -0,0 +1,22 @@
+#include "assert.h"
+#include "fcntl.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+#include "unistd.h"
+
+#define CHUNK_SIZE 64
+#define ITERATIONS 16384
+
+int main() {
+  const char chunk_buf[CHUNK_SIZE] = {0};
+
+  int fd = open("/tmp/small_writes.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+
+  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
+    assert(write(fd, chunk_buf, CHUNK_SIZE) == CHUNK_SIZE);
+  }
+
+  assert(close(fd) == 0);
+}
@@ -1,15 +1,23 @@
 #include "assert.h"
 #include "stdint.h"
-#include "stdio.h"
+#include "stdlib.h"
 #include "string.h"
+#include "unistd.h"
 
-#define CHUNK_SIZE 4096
-#define ITERATIONS 1024
+#define DEFAULT_CHUNK_SIZE 4096
 
-int main() {
-  const char *chunk_buf[CHUNK_SIZE] = {0};
+// reads stdin until EOF in chunks of argv[1] bytes, bypassing stdio
+// buffering so every chunk is a syscall
+int main(int argc, char **argv) {
+  const int chunk_size = argc > 1 ? atoi(argv[1]) : DEFAULT_CHUNK_SIZE;
+  assert(chunk_size > 0);
+  char *chunk_buf = malloc(chunk_size);
+  assert(chunk_buf);
 
-  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
-    fread(chunk_buf, 1, CHUNK_SIZE, stdin);
+  ssize_t read_bytes;
+  while ((read_bytes = read(STDIN_FILENO, chunk_buf, chunk_size)) > 0) {
   }
+  assert(read_bytes == 0);
+
+  free(chunk_buf);
 }
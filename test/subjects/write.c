@@ -1,17 +1,23 @@
 #include "assert.h"
 #include "stdint.h"
-#include "stdio.h"
+#include "stdlib.h"
 #include "string.h"
+#include "unistd.h"
 
-#define CHUNK_SIZE 4096
-#define ITERATIONS 1024
+#define DEFAULT_CHUNK_SIZE 4096
+#define TOTAL_SIZE (4 * 1024 * 1024)
 
-int main() {
-  const char *chunk_buf[CHUNK_SIZE] = {0};
+// writes TOTAL_SIZE bytes to stdout in chunks of argv[1] bytes, bypassing
+// stdio buffering so every chunk is a syscall
+int main(int argc, char **argv) {
+  const int chunk_size = argc > 1 ? atoi(argv[1]) : DEFAULT_CHUNK_SIZE;
+  assert(chunk_size > 0);
+  char *chunk_buf = calloc(chunk_size, 1);
+  assert(chunk_buf);
 
-  for (int iterations = 0; iterations < ITERATIONS; iterations++) {
-    fwrite(chunk_buf, 1, CHUNK_SIZE, stdout);
+  for (int written = 0; written < TOTAL_SIZE; written += chunk_size) {
+    assert(write(STDOUT_FILENO, chunk_buf, chunk_size) == chunk_size);
   }
 
-  fflush(stdout);
+  free(chunk_buf);
 }
@@ -1,7 +1,11 @@
 import fs from 'fs/promises'
 import path from 'path'
 import * as utils from './utils'
-import type { Environment } from '@cloudflare/workers-wasi'
+import type {
+  Environment,
+  StreamStdioBackend,
+} from '@cloudflare/workers-wasi'
+import type { FSSource } from './driver/common'
 
 interface Config {
   env?: Environment
@@ -55,7 +59,10 @@ const readConfig = async (file: string): Promise<Config> => {
 const generateTestCases = async (
   fixture: utils.TestEnv,
   asyncify: boolean,
-  dir: string
+  dir: string,
+  fsSource: FSSource = 'options',
+  stdinSpillThreshold?: number,
+  streamStdioBackend?: StreamStdioBackend
 ) => {
   const wasmFiles = await utils.filesWithExt(dir, '.wasm')
   for (const file of wasmFiles) {
@@ -67,18 +74,29 @@ const generateTestCases = async (
     }
 
     const moduleName = path.join('wasi-test-suite', path.basename(dir), file)
+    const variants = [
+      ...(fsSource === 'options' ? [] : [fsSource]),
+      ...(stdinSpillThreshold === undefined ? [] : ['spilled stdin']),
+      ...(streamStdioBackend === 'jspi' ? ['jspi'] : []),
+    ]
+    const testName = variants.length
+      ? `${moduleName} (${variants.join(', ')})`
+      : moduleName
 
     const preopensDir = path.basename(utils.withExtension(file, '.dir'))
     const fs = await utils.readfs(utils.withExtension(absFile, '.dir'))
-    test(moduleName, async () => {
+    test(testName, async () => {
       const result = await fixture.exec({
         preopens: ['/' + preopensDir],
         fs,
+        fsSource,
         asyncify,
         args,
         env: config.env,
         moduleName,
         stdin: config.stdin,
+        stdinSpillThreshold,
+        streamStdioBackend: asyncify ? streamStdioBackend : undefined,
         returnOnExit: config.status !== undefined,
       })
       if (config.status) {
@@ -91,10 +109,31 @@ const generateTestCases = async (
   }
 }
 
+// JSPI is preferred when the engine supports it, asyncify is requested
+// explicitly so both are covered
+const supportsJSPI = typeof (WebAssembly as any).Suspending === 'function'
+
 await utils.withEnv(async (fixture: utils.TestEnv) => {
-  await generateTestCases(fixture, true, '../deps/wasi-test-suite/libc/')
-  await generateTestCases(fixture, true, '../deps/wasi-test-suite/libstd/')
+  const libc = '../deps/wasi-test-suite/libc/'
+  const libstd = '../deps/wasi-test-suite/libstd/'
+  const backends: Array<StreamStdioBackend> = supportsJSPI
+    ? ['asyncify', 'jspi']
+    : ['asyncify']
+  for (const backend of backends) {
+    for (const dir of [libc, libstd]) {
+      await generateTestCases(fixture, true, dir, 'options', undefined, backend)
+    }
+  }
+
+  // the same fixtures, loaded on first open, streamed in after construction
+  // and streamed over manifest entries that must not be loaded anymore
+  await generateTestCases(fixture, true, libc, 'lazy')
+  await generateTestCases(fixture, true, libc, 'addFile')
+  await generateTestCases(fixture, true, libc, 'addFileOverLazy')
 
   // assemblyscript tests not compatible with default asyncify memory layout
-  await generateTestCases(fixture, false, '../deps/wasi-test-suite/core/')
+  const core = '../deps/wasi-test-suite/core/'
+  await generateTestCases(fixture, false, core)
+  // stdin beyond the first byte is kept in the filesystem
+  await generateTestCases(fixture, false, core, 'options', 1)
 })
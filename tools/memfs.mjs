@@ -0,0 +1,105 @@
+// @ts-check
+//
+// Minimal host for running memfs.wasm from build tools, outside of the MemFS
+// class used at runtime.
+
+import * as fs from 'node:fs/promises'
+
+const ENOSYS = 52
+
+const unsupported = () => {
+  throw new Error('unsupported outside of MemFS')
+}
+
+/**
+ * Instantiates memfs.wasm with host imports suitable for build tools and runs
+ * its initialization unless the module was pre-initialized. The exports taking
+ * WASI arguments can only be called with a `hostMemory`, whose addresses they
+ * take in place of the application's.
+ *
+ * @param {string} path
+ * @param {{ initialize?: boolean, hostMemory?: () => Uint8Array }} options
+ */
+export const instantiate = async (path, options = {}) => {
+  const module = new WebAssembly.Module(await fs.readFile(path))
+
+  /** @type {any} */
+  let exports
+  const memory = () => new Uint8Array(exports.memory.buffer)
+  const { hostMemory } = options
+
+  /**
+   * @param {Uint8Array} src
+   * @param {Uint8Array} dst
+   * @param {number} regionsAddr
+   * @param {number} count
+   */
+  const copyRegions = (src, dst, regionsAddr, count) => {
+    const regions = new Int32Array(
+      exports.memory.buffer,
+      regionsAddr,
+      count * 3
+    )
+    for (let i = 0; i < regions.length; i += 3) {
+      const [srcAddr, dstAddr, size] = regions.subarray(i, i + 3)
+      dst.set(src.subarray(srcAddr, srcAddr + size), dstAddr)
+    }
+  }
+
+  const instance = new WebAssembly.Instance(module, {
+    internal: {
+      now_ms: () => Date.now(),
+      trace: (isError, addr, size) => {
+        const view = memory().subarray(addr, addr + size)
+        const s = new TextDecoder().decode(view)
+        if (isError) {
+          throw new Error(s)
+        }
+        console.info(s)
+      },
+      copy_out: hostMemory
+        ? (srcAddr, dstAddr, size) =>
+            hostMemory().set(
+              memory().subarray(srcAddr, srcAddr + size),
+              dstAddr
+            )
+        : unsupported,
+      copy_in: hostMemory
+        ? (srcAddr, dstAddr, size) =>
+            memory().set(
+              hostMemory().subarray(srcAddr, srcAddr + size),
+              dstAddr
+            )
+        : unsupported,
+      copy_out_batch: hostMemory
+        ? (regionsAddr, count) =>
+            copyRegions(memory(), hostMemory(), regionsAddr, count)
+        : unsupported,
+      copy_in_batch: hostMemory
+        ? (regionsAddr, count) =>
+            copyRegions(hostMemory(), memory(), regionsAddr, count)
+        : unsupported,
+      base_read: () => 0,
+      lazy_load: () => -1,
+    },
+    wasi_snapshot_preview1: {
+      proc_exit: () => {},
+      fd_seek: () => ENOSYS,
+      fd_write: () => ENOSYS,
+      fd_close: () => ENOSYS,
+    },
+  })
+  exports = instance.exports
+
+  if ((options.initialize ?? true) && !exports.is_initialized()) {
+    exports._start()
+  }
+
+  const copyIn = (/** @type {Uint8Array} */ data) => {
+    const addr = exports.allocate(Math.max(data.byteLength, 1))
+    memory().set(data, addr)
+    return addr
+  }
+
+  return { module, instance, exports, memory, copyIn }
+}
@@ -0,0 +1,73 @@
+#!/usr/bin/env node
+// @ts-check
+//
+// Builds a filesystem image from a directory tree, the result can be passed as
+// `fsImage` to `new WASI()` and is mounted with a single copy instead of
+// writing every file at startup.
+//
+//   mkimage.mjs <directory> <output> [mount point]
+//
+// Files are placed under the mount point, which defaults to
+// `/<directory name>`.
+
+import * as fs from 'node:fs/promises'
+import * as path from 'node:path'
+import * as url from 'node:url'
+import { instantiate } from './memfs.mjs'
+
+const __dirname = path.dirname(url.fileURLToPath(import.meta.url))
+const MEMFS_PATH = path.resolve(__dirname, '../dist/memfs.wasm')
+
+const [inputDir, outputFile, mountPoint] = process.argv.slice(2)
+if (!inputDir || !outputFile) {
+  console.error('usage: mkimage.mjs <directory> <output> [mount point]')
+  process.exit(1)
+}
+
+/** @returns {Promise<string[]>} */
+const recurseFiles = async (/** @type {string} */ dir) => {
+  const entries = await fs.readdir(dir, { withFileTypes: true })
+  return (
+    await Promise.all(
+      entries.map(async (dirent) => {
+        const file = path.join(dir, dirent.name)
+        return dirent.isDirectory() ? recurseFiles(file) : [file]
+      })
+    )
+  ).flat()
+}
+
+const { exports, memory, copyIn } = await instantiate(MEMFS_PATH)
+
+const root = path.resolve(inputDir)
+const prefix = mountPoint ?? `/${path.basename(root)}`
+const encoder = new TextEncoder()
+
+for (const file of await recurseFiles(root)) {
+  const relative = path.relative(root, file).split(path.sep)
+  const target = path.posix.join(prefix, ...relative)
+  const name = encoder.encode(target)
+  const data = await fs.readFile(file)
+
+  const nameAddr = copyIn(name)
+  const dataAddr = copyIn(data)
+  const result = exports.write_file(
+    nameAddr,
+    name.byteLength,
+    dataAddr,
+    data.byteLength
+  )
+  exports.deallocate(nameAddr)
+  exports.deallocate(dataAddr)
+  if (result !== 0) {
+    throw new Error(`failed to write ${target}: ${result}`)
+  }
+}
+
+const sizeAddr = exports.allocate(4)
+const imageAddr = exports.image_save(sizeAddr)
+const size = new DataView(exports.memory.buffer).getUint32(sizeAddr, true)
+if (imageAddr === 0) {
+  throw new Error('failed to save image')
+}
+await fs.writeFile(outputFile, memory().slice(imageAddr, imageAddr + size))
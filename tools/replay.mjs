@@ -0,0 +1,393 @@
+#!/usr/bin/env node
+// @ts-check
+//
+// Replays the filesystem calls of a trace recorded with `WASIOptions.trace`
+// against memfs.wasm, without the application that made them. Paths and
+// iovec sizes come from the trace, pointers are redirected to a scratch
+// buffer and written data is zero filled.
+//
+//   replay.mjs <trace> [options]
+//
+// Calls that memfs doesn't serve, like clocks or stdio, are skipped. The
+// filesystem must start out as it did when the trace was recorded, pass the
+// same preopens and image, otherwise results will differ from the recorded
+// ones. A trace whose ring buffer wrapped around starts in the middle of the
+// run and is only replayed faithfully if it doesn't use descriptors or files
+// from before its first record.
+
+import * as fs from 'node:fs/promises'
+import * as path from 'node:path'
+import * as url from 'node:url'
+import { instantiate } from './memfs.mjs'
+
+const __dirname = path.dirname(url.fileURLToPath(import.meta.url))
+const MEMFS_PATH = path.resolve(__dirname, '../dist/memfs.wasm')
+
+const USAGE = `usage: replay.mjs <trace> [options]
+
+  --preopen=PATH      preopened directory, in the order of WASIOptions.preopens,
+                      can be repeated
+  --image=FILE        filesystem image to start from, see mkimage.mjs
+  --sync-mode=MODE    strict or write-back (strict)
+  --iterations=N      replay the trace N times, resetting the filesystem in
+                      between (1)
+  --memfs=FILE        memfs.wasm to replay against (dist/memfs.wasm)
+  --json=FILE         write the results for benchmark-compare.mjs
+`
+
+// see TraceRecorder in src/trace.ts
+const TRACE_MAGIC = 0x43525457
+const TRACE_VERSION = 1
+const TRACE_HEADER_SIZE = 20
+const RECORD_HEADER_SIZE = 24
+const POINTER_HEADER_SIZE = 8
+const POINTER_INPUT = 0
+const POINTER_IOVECS = 1
+
+// served by the host's streams rather than memfs below this descriptor
+const STDIO_IMPORTS = new Set(['fd_read', 'fd_write'])
+const FIRST_FILE_FD = 3
+
+// field order of MemFSStats in src/memfs.ts
+const STATS_FIELDS = [
+  'deviceReads',
+  'deviceReadBytes',
+  'baseImageReads',
+  'deviceProgs',
+  'deviceProgBytes',
+  'deviceErases',
+  'blockCount',
+  'blocksInUse',
+  'blocksAllocated',
+  'blocksRetained',
+  'memoryBytes',
+  'dynamicMemoryBytes',
+]
+
+/** @param {number} size */
+const align4 = (size) => (size + 3) & ~3
+/** @param {number} size */
+const align8 = (size) => (size + 7) & ~7
+
+/**
+ * @typedef {{
+ *   kind: number,
+ *   arg: number,
+ *   length: number,
+ *   data?: Uint8Array,
+ *   sizes?: number[],
+ * }} Pointer
+ * @typedef {{
+ *   name: string,
+ *   args: Array<number | bigint>,
+ *   pointers: Pointer[],
+ *   result: number,
+ *   time: number,
+ * }} TraceRecord
+ */
+
+/**
+ * @param {Uint8Array} bytes
+ * @returns {{ records: TraceRecord[], dropped: number }}
+ */
+const parseTrace = (bytes) => {
+  const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength)
+  if (
+    bytes.byteLength < TRACE_HEADER_SIZE ||
+    view.getUint32(0, true) !== TRACE_MAGIC ||
+    view.getUint32(4, true) !== TRACE_VERSION
+  ) {
+    throw new Error('invalid trace')
+  }
+  const count = view.getUint32(8, true)
+  const dropped = view.getUint32(12, true)
+  const namesLength = view.getUint32(16, true)
+  const names = new TextDecoder()
+    .decode(bytes.subarray(TRACE_HEADER_SIZE, TRACE_HEADER_SIZE + namesLength))
+    .split('\n')
+
+  /** @type {TraceRecord[]} */
+  const records = []
+  let offset = TRACE_HEADER_SIZE + align4(namesLength)
+  for (let i = 0; i < count; ++i) {
+    const size = view.getUint32(offset, true)
+    const argc = view.getUint8(offset + 5)
+    const pointerCount = view.getUint8(offset + 6)
+    const wide = view.getUint32(offset + 8, true)
+
+    let at = offset + RECORD_HEADER_SIZE
+    const args = []
+    for (let j = 0; j < argc; ++j) {
+      if (wide & (1 << j)) {
+        args.push(view.getBigInt64(at, true))
+        at += 8
+      } else {
+        args.push(view.getInt32(at, true))
+        at += 4
+      }
+    }
+
+    const pointers = []
+    for (let j = 0; j < pointerCount; ++j) {
+      /** @type {Pointer} */
+      const pointer = {
+        kind: view.getUint8(at),
+        arg: view.getUint8(at + 1),
+        length: view.getUint32(at + 4, true),
+      }
+      at += POINTER_HEADER_SIZE
+      if (pointer.kind === POINTER_INPUT) {
+        pointer.data = bytes.subarray(at, at + pointer.length)
+        at += align4(pointer.length)
+      } else if (pointer.kind === POINTER_IOVECS) {
+        pointer.sizes = []
+        for (let k = 0; k < pointer.length; ++k) {
+          pointer.sizes.push(view.getUint32(at, true))
+          at += 4
+        }
+      }
+      pointers.push(pointer)
+    }
+
+    records.push({
+      name: names[view.getUint8(offset + 4)],
+      args,
+      pointers,
+      result: view.getInt32(offset + 12, true),
+      time: view.getFloat64(offset + 16, true),
+    })
+    offset += size
+  }
+  return { records, dropped }
+}
+
+/**
+ * Scratch memory used by the pointers of `record`, every allocation is 8 byte
+ * aligned
+ *
+ * @param {TraceRecord} record
+ */
+const scratchSize = (record) => {
+  let size = 0
+  for (const { kind, length, sizes } of record.pointers) {
+    if (kind === POINTER_IOVECS) {
+      size += length * 8
+      for (const iovSize of sizes ?? []) {
+        size += align8(iovSize)
+      }
+    } else {
+      size += align8(length)
+    }
+  }
+  return size
+}
+
+/**
+ * Lays out the pointers of `record` in `host` starting at `base`, returns the
+ * arguments to call the export with and a function writing the inputs and
+ * iovecs, which later calls may overwrite
+ *
+ * @param {TraceRecord} record
+ * @param {Uint8Array} host
+ * @param {number} base
+ */
+const prepare = (record, host, base) => {
+  const args = [...record.args]
+  /** @type {Array<() => void>} */
+  const writes = []
+  let addr = base
+  for (const { kind, arg, length, data, sizes } of record.pointers) {
+    args[arg] = addr
+    if (kind === POINTER_INPUT && data) {
+      const at = addr
+      writes.push(() => host.set(data, at))
+      addr += align8(length)
+    } else if (kind === POINTER_IOVECS && sizes) {
+      const iovs = new DataView(host.buffer, addr, length * 8)
+      addr += length * 8
+      /** @type {number[]} */
+      const entries = []
+      for (const size of sizes) {
+        entries.push(addr, size)
+        addr += align8(size)
+      }
+      writes.push(() =>
+        entries.forEach((value, i) => iovs.setUint32(i * 4, value, true))
+      )
+    } else {
+      addr += align8(length)
+    }
+  }
+  return { args, write: () => writes.forEach((write) => write()) }
+}
+
+// `p` of the sorted `samples` in microseconds
+const percentile = (
+  /** @type {number[]} */ samples,
+  /** @type {number} */ p
+) => {
+  if (samples.length === 0) return 0
+  const index = Math.min(samples.length - 1, Math.floor(samples.length * p))
+  return Math.round(samples[index] * 1000 * 100) / 100
+}
+
+/** @param {number[]} samples */
+const summarize = (samples) => {
+  samples.sort((a, b) => a - b)
+  return {
+    calls: samples.length,
+    p50Us: percentile(samples, 0.5),
+    p99Us: percentile(samples, 0.99),
+  }
+}
+
+const main = async () => {
+  const argv = process.argv.slice(2)
+  const positional = argv.filter((arg) => !arg.startsWith('--'))
+  /** @type {Record<string, string[]>} */
+  const flags = {}
+  for (const arg of argv.filter((arg) => arg.startsWith('--'))) {
+    const [key, value] = arg.slice(2).split('=')
+    ;(flags[key] ??= []).push(value ?? '')
+  }
+  if (positional.length !== 1 || flags.help) {
+    process.stderr.write(USAGE)
+    return 2
+  }
+  const [tracePath] = positional
+  const iterations = Number(flags.iterations?.[0] ?? 1)
+
+  const { records, dropped } = parseTrace(await fs.readFile(tracePath))
+  if (dropped > 0) {
+    console.warn(
+      `${tracePath}: ${dropped} calls were dropped while recording, results may differ`
+    )
+  }
+
+  let host = new Uint8Array(0)
+  const { exports } = await instantiate(flags.memfs?.[0] ?? MEMFS_PATH, {
+    hostMemory: () => host,
+  })
+
+  const copyIn = (/** @type {Uint8Array} */ data) => {
+    const addr = exports.allocate(Math.max(data.byteLength, 1))
+    new Uint8Array(exports.memory.buffer).set(data, addr)
+    return addr
+  }
+
+  if (flags.image) {
+    const image = await fs.readFile(flags.image[0])
+    const result = exports.image_load(copyIn(image), image.byteLength)
+    if (result !== 0) {
+      throw new Error(`failed to load filesystem image: ${result}`)
+    }
+  }
+  const config = new TextEncoder().encode(
+    JSON.stringify({
+      preopens: flags.preopen ?? [],
+      fs: {},
+      syncMode: flags['sync-mode']?.[0],
+      reusable: iterations > 1,
+    })
+  )
+  exports.initialize_internal(copyIn(config), config.byteLength)
+
+  const replayed = records.filter(
+    ({ name, args }) =>
+      typeof exports[name] === 'function' &&
+      !(STDIO_IMPORTS.has(name) && Number(args[0]) < FIRST_FILE_FD)
+  )
+  host = new Uint8Array(
+    Math.max(8, ...replayed.map((record) => 8 + scratchSize(record)))
+  )
+  const calls = replayed.map((record) => ({
+    record,
+    f: exports[record.name],
+    ...prepare(record, host, 8),
+  }))
+
+  /** @type {Record<string, number[]>} */
+  const latencies = {}
+  /** @type {string[]} */
+  const mismatches = []
+  const started = performance.now()
+  for (let i = 0; i < iterations; ++i) {
+    if (i > 0) {
+      const result = exports.reset()
+      if (result !== 0) {
+        throw new Error(`failed to reset filesystem: ${result}`)
+      }
+    }
+    for (const { record, f, args, write } of calls) {
+      write()
+      const callStarted = performance.now()
+      const result = f(...args)
+      ;(latencies[record.name] ??= []).push(performance.now() - callStarted)
+      if (i === 0 && result !== record.result) {
+        mismatches.push(
+          `${record.name}(${record.args.join(', ')}) = ${result}, recorded ${
+            record.result
+          }`
+        )
+      }
+    }
+    exports.flush()
+  }
+  const seconds = (performance.now() - started) / 1000
+
+  const all = Object.values(latencies).flat()
+  const { p50Us, p99Us } = summarize(all)
+  /** @type {Record<string, number> | undefined} */
+  let fsStats
+  if (exports.stats) {
+    const statsAddr = exports.allocate(STATS_FIELDS.length * 8)
+    if (exports.stats(statsAddr) === 0) {
+      const view = new DataView(exports.memory.buffer)
+      fsStats = Object.fromEntries(
+        STATS_FIELDS.map((field, i) => [
+          field,
+          Number(view.getBigUint64(statsAddr + i * 8, true)),
+        ])
+      )
+    }
+    exports.deallocate(statsAddr)
+  }
+  const results = {
+    ops: all.length,
+    opsPerSec: Math.round(all.length / seconds),
+    p50Us,
+    p99Us,
+    peakMemoryBytes: exports.memory.buffer.byteLength,
+    skipped: records.length - replayed.length,
+    mismatches: mismatches.length,
+    fsStats,
+    imports: Object.fromEntries(
+      Object.entries(latencies).map(([name, samples]) => [
+        name,
+        summarize(samples),
+      ])
+    ),
+  }
+
+  console.log(
+    `${tracePath}: replayed ${replayed.length} of ${records.length} calls ` +
+      `${iterations} times, ${results.opsPerSec} calls/sec, ` +
+      `p50 ${p50Us}us, p99 ${p99Us}us`
+  )
+  if (mismatches.length > 0) {
+    console.log(`${mismatches.length} calls returned a different result:`)
+    for (const mismatch of mismatches.slice(0, 10)) {
+      console.log(`  ${mismatch}`)
+    }
+  }
+  if (flags.json) {
+    const name = path.basename(tracePath)
+    await fs.writeFile(
+      flags.json[0],
+      JSON.stringify({ [name]: results }, null, 2) + '\n'
+    )
+  }
+  return 0
+}
+
+process.exit(await main())
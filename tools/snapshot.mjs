@@ -0,0 +1,268 @@
+#!/usr/bin/env node
+// @ts-check
+//
+// Wizer-style pre-initialization of memfs.wasm: runs `_start`, which formats
+// and mounts the filesystem, and writes out a module whose data segments hold
+// the resulting linear memory. Instances of the output module start with a
+// mounted filesystem and must not call `_start` again, see `is_initialized`.
+//
+//   snapshot.mjs <input.wasm> <output.wasm>
+//
+// Only linear memory is captured. This is sufficient for wasi-sdk output,
+// whose sole mutable global is `__stack_pointer` and which is restored by the
+// time `_start` returns; modules with other mutable globals are rejected.
+
+import * as fs from 'node:fs/promises'
+import { instantiate } from './memfs.mjs'
+
+const SECTION_GLOBAL = 6
+const SECTION_MEMORY = 5
+const SECTION_DATA = 11
+const SECTION_DATA_COUNT = 12
+
+const PAGE_SIZE = 65536
+// zero runs shorter than this are kept inside a segment rather than splitting
+// it, keeps the number of segments low
+const MIN_ZERO_RUN = 64
+
+const [input, output] = process.argv.slice(2)
+if (!input || !output) {
+  console.error('usage: snapshot.mjs <input.wasm> <output.wasm>')
+  process.exit(1)
+}
+
+class Reader {
+  /** @param {Uint8Array} bytes */
+  constructor(bytes) {
+    this.bytes = bytes
+    this.offset = 0
+  }
+
+  byte() {
+    return this.bytes[this.offset++]
+  }
+
+  u32() {
+    let result = 0
+    let shift = 0
+    for (;;) {
+      const byte = this.byte()
+      result |= (byte & 0x7f) << shift
+      shift += 7
+      if ((byte & 0x80) === 0) {
+        return result >>> 0
+      }
+    }
+  }
+
+  skipLeb() {
+    while (this.byte() & 0x80) {}
+  }
+
+  /** @param {number} length */
+  skip(length) {
+    this.offset += length
+  }
+}
+
+/** @param {number} value */
+const encodeU32 = (value) => {
+  const result = []
+  do {
+    let byte = value & 0x7f
+    value >>>= 7
+    if (value !== 0) {
+      byte |= 0x80
+    }
+    result.push(byte)
+  } while (value !== 0)
+  return result
+}
+
+/** @param {number} value */
+const encodeI32 = (value) => {
+  const result = []
+  value |= 0
+  for (;;) {
+    const byte = value & 0x7f
+    value >>= 7
+    const done =
+      (value === 0 && (byte & 0x40) === 0) ||
+      (value === -1 && (byte & 0x40) !== 0)
+    result.push(done ? byte : byte | 0x80)
+    if (done) {
+      return result
+    }
+  }
+}
+
+/**
+ * @param {number} id
+ * @param {ArrayLike<number>[]} parts
+ */
+const encodeSection = (id, parts) => {
+  const size = parts.reduce((acc, part) => acc + part.length, 0)
+  return [
+    Uint8Array.of(id, ...encodeU32(size)),
+    ...parts.map((part) => Uint8Array.from(part)),
+  ]
+}
+
+/** @param {Uint8Array} bytes */
+const parseSections = (bytes) => {
+  const reader = new Reader(bytes)
+  reader.skip(8) // magic and version
+
+  const sections = []
+  while (reader.offset < bytes.length) {
+    const id = reader.byte()
+    const size = reader.u32()
+    const start = reader.offset
+    sections.push({ id, contents: bytes.subarray(start, start + size) })
+    reader.skip(size)
+  }
+  return sections
+}
+
+/** @param {Uint8Array} contents */
+const countMutableGlobals = (contents) => {
+  const reader = new Reader(contents)
+  let mutable = 0
+  for (let count = reader.u32(); count > 0; --count) {
+    reader.byte() // value type
+    mutable += reader.byte()
+
+    // constant initializer expression
+    for (let op = reader.byte(); op !== 0x0b; op = reader.byte()) {
+      switch (op) {
+        case 0x41: // i32.const
+        case 0x42: // i64.const
+        case 0x23: // global.get
+          reader.skipLeb()
+          break
+        case 0x43: // f32.const
+          reader.skip(4)
+          break
+        case 0x44: // f64.const
+          reader.skip(8)
+          break
+        default:
+          throw new Error(`unsupported global initializer opcode ${op}`)
+      }
+    }
+  }
+  return mutable
+}
+
+/** @param {Uint8Array} contents */
+const hasPassiveSegments = (contents) => {
+  const reader = new Reader(contents)
+  for (let count = reader.u32(); count > 0; --count) {
+    const flags = reader.u32()
+    if (flags === 1) {
+      return true
+    }
+    if (flags === 2) {
+      reader.u32() // memory index
+    }
+    for (let op = reader.byte(); op !== 0x0b; op = reader.byte()) {
+      reader.skipLeb()
+    }
+    reader.skip(reader.u32())
+  }
+  return false
+}
+
+/**
+ * Active data segments covering every non-zero byte of `memory`
+ * @param {Uint8Array} memory
+ */
+const encodeDataSegments = (memory) => {
+  const segments = []
+  let offset = 0
+  while (offset < memory.length) {
+    while (offset < memory.length && memory[offset] === 0) {
+      ++offset
+    }
+    if (offset === memory.length) {
+      break
+    }
+
+    const start = offset
+    let zeros = 0
+    for (; offset < memory.length && zeros < MIN_ZERO_RUN; ++offset) {
+      zeros = memory[offset] === 0 ? zeros + 1 : 0
+    }
+    const end = offset - zeros
+
+    const data = memory.subarray(start, end)
+    segments.push(
+      Uint8Array.of(0, 0x41, ...encodeI32(start), 0x0b),
+      Uint8Array.from(encodeU32(data.length)),
+      data
+    )
+  }
+  return [Uint8Array.from(encodeU32(segments.length / 3)), ...segments]
+}
+
+/**
+ * @param {Uint8Array} contents
+ * @param {number} pages
+ */
+const encodeMemory = (contents, pages) => {
+  const reader = new Reader(contents)
+  if (reader.u32() !== 1) {
+    throw new Error('expected a single memory')
+  }
+  const flags = reader.byte()
+  reader.u32() // initial pages
+  if (flags & 1) {
+    const maximum = reader.u32()
+    return Uint8Array.of(1, flags, ...encodeU32(pages), ...encodeU32(maximum))
+  }
+  return Uint8Array.of(1, flags, ...encodeU32(pages))
+}
+
+const bytes = new Uint8Array(await fs.readFile(input))
+const sections = parseSections(bytes)
+
+for (const section of sections) {
+  if (
+    section.id === SECTION_GLOBAL &&
+    countMutableGlobals(section.contents) > 1
+  ) {
+    throw new Error('only __stack_pointer may be a mutable global')
+  }
+  if (section.id === SECTION_DATA && hasPassiveSegments(section.contents)) {
+    throw new Error('passive data segments are not supported')
+  }
+}
+
+const { exports } = await instantiate(input)
+if (!exports.is_initialized()) {
+  throw new Error('memfs did not initialize')
+}
+const memory = new Uint8Array(exports.memory.buffer)
+
+const result = [bytes.subarray(0, 8)]
+for (const { id, contents } of sections) {
+  switch (id) {
+    case SECTION_MEMORY:
+      result.push(
+        ...encodeSection(id, [
+          encodeMemory(contents, memory.length / PAGE_SIZE),
+        ])
+      )
+      break
+    case SECTION_DATA_COUNT:
+      // only required for bulk memory instructions, which are rejected above
+      break
+    case SECTION_DATA:
+      result.push(...encodeSection(id, encodeDataSegments(memory)))
+      break
+    default:
+      result.push(...encodeSection(id, [contents]))
+  }
+}
+
+await fs.writeFile(output, Buffer.concat(result))